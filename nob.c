@@ -4,6 +4,92 @@
 // Some folder paths that we use throughout the build process.
 #define BUILD_FOLDER "build/"
 #define SRC_FOLDER   "src/"
+#define TESTS_FOLDER "tests/"
+
+// Scripts `./nob check` renders: shapes, a long repeat, pen changes, procedure calls and a swarm.
+static const char *check_scripts[] = {
+    TESTS_FOLDER"shapes.logo",
+    TESTS_FOLDER"spiral.logo",
+    TESTS_FOLDER"pens.logo",
+    TESTS_FOLDER"procs.logo",
+    TESTS_FOLDER"swarm.logo",
+};
+
+// Threads the check compares a single thread against.
+#define CHECK_THREADS "8"
+
+// Renders script with the batch mode of main into out, its log going next to it. Returns the
+// number of lines the run's summary reports, or -1 if it failed.
+static long render(Nob_Cmd *cmd, const char *script, const char *threads, bool closed_form, const char *out)
+{
+    const char *log = nob_temp_sprintf("%s.log", out);
+    nob_cmd_append(cmd, "./"BUILD_FOLDER"main", "--threads", threads);
+    if (closed_form) nob_cmd_append(cmd, "--closed-form");
+    nob_cmd_append(cmd, "--script", script, "--out", out);
+    Nob_Fd fderr = nob_fd_open_for_write(log);
+    if (fderr == NOB_INVALID_FD) return -1;
+    if (!nob_cmd_run_sync_redirect_and_reset(cmd, (Nob_Cmd_Redirect) { .fderr = &fderr })) return -1;
+
+    Nob_String_Builder sb = {0};
+    long lines = -1;
+    if (nob_read_entire_file(log, &sb)) {
+        nob_sb_append_null(&sb);
+        const char *summary = strstr(sb.items, "rendered ");
+        if (summary == NULL || sscanf(summary, "rendered %*u/%*u scripts (%ld lines", &lines) != 1) lines = -1;
+    }
+    nob_sb_free(sb);
+    return lines;
+}
+
+static bool same_file(const char *a, const char *b)
+{
+    Nob_String_Builder sa = {0}, sb = {0};
+    bool same = nob_read_entire_file(a, &sa) && nob_read_entire_file(b, &sb)
+        && sa.count == sb.count && memcmp(sa.items, sb.items, sa.count) == 0;
+    nob_sb_free(sa);
+    nob_sb_free(sb);
+    return same;
+}
+
+// Regression check of the batch mode: images must not depend on the thread count, with or
+// without --closed-form, and closed form chunks must draw as many lines as stepping through.
+static bool check(Nob_Cmd *cmd)
+{
+    if (!nob_mkdir_if_not_exists(BUILD_FOLDER"check")) return false;
+    size_t failed = 0;
+    for (size_t i = 0; i < NOB_ARRAY_LEN(check_scripts); ++i) {
+        const char *script = check_scripts[i];
+        const char *name = nob_path_name(script);
+        long lines[2] = {0};
+        bool ok = true;
+        for (int closed_form = 0; closed_form < 2; ++closed_form) {
+            const char *mode = closed_form ? " --closed-form" : "";
+            const char *one = nob_temp_sprintf(BUILD_FOLDER"check/%s%s.1.ppm", name, closed_form ? ".cf" : "");
+            const char *many = nob_temp_sprintf(BUILD_FOLDER"check/%s%s."CHECK_THREADS".ppm", name, closed_form ? ".cf" : "");
+            lines[closed_form] = render(cmd, script, "1", closed_form, one);
+            long many_lines = render(cmd, script, CHECK_THREADS, closed_form, many);
+            if (lines[closed_form] < 0 || many_lines < 0) {
+                nob_log(NOB_ERROR, "%s%s: render failed, see %s.log", script, mode, one);
+                ok = false;
+            } else if (lines[closed_form] != many_lines || !same_file(one, many)) {
+                nob_log(NOB_ERROR, "%s%s: 1 and "CHECK_THREADS" threads draw different images", script, mode);
+                ok = false;
+            }
+        }
+        if (ok && lines[0] != lines[1]) {
+            nob_log(NOB_ERROR, "%s: %ld lines, %ld with --closed-form", script, lines[0], lines[1]);
+            ok = false;
+        }
+        if (ok) nob_log(NOB_INFO, "%s: ok, %ld lines", script, lines[0]);
+        if (!ok) failed++;
+    }
+
+    // The kernel benchmark also checks every SIMD kernel against the scalar one.
+    nob_cmd_append(cmd, "./"BUILD_FOLDER"main", "--threads", CHECK_THREADS, "--bench");
+    if (!nob_cmd_run_sync_and_reset(cmd)) failed++;
+    nob_log(failed ? NOB_ERROR : NOB_INFO, "check: %zu of %zu checks failed", failed, NOB_ARRAY_LEN(check_scripts) + 1);
+    return failed == 0;
+}
 
 int main(int argc, char **argv)
 {
@@ -17,7 +103,9 @@ int main(int argc, char **argv)
     // command line that you want to execute.
     Nob_Cmd cmd = {0};
 
-    //nob_cmd_append(&cmd, "cc", "-ggdb", "-Wall", "-Wextra", "-o", BUILD_FOLDER"main", SRC_FOLDER"main.c");
+    // The SIMD coverage kernels in main.c only match the scalar one bit for bit while the
+    // compiler doesn't fuse multiplies and adds into FMAs, so keep -ffp-contract=off.
+    //nob_cmd_append(&cmd, "cc", "-ggdb", "-Wall", "-Wextra", "-ffp-contract=off", "-o", BUILD_FOLDER"main", SRC_FOLDER"main.c");
     //nob_cmd_append(&cmd, "-lraylib", "-lGL", "-lm", "-lpthread", "-ldl", "-lrt", "-lX11");
     
     nob_cmd_append(&cmd, "cc", "-ggdb", "-Wall", "-Wextra", "-o", BUILD_FOLDER"parser", SRC_FOLDER"parser.c");
@@ -30,6 +118,17 @@ int main(int argc, char **argv)
       if (strcmp(param, "run") == 0) {
         nob_cmd_append(&cmd, "./"BUILD_FOLDER"/main");
         if (!nob_cmd_run_sync_and_reset(&cmd)) return 1;
+      } else if (strcmp(param, "alloc-stats") == 0) {
+        // Counts heap calls per frame and per command and asserts the steady state makes none.
+        nob_cmd_append(&cmd, "cc", "-ggdb", "-Wall", "-Wextra", "-ffp-contract=off", "-DTURTLE_ALLOC_STATS", "-o", BUILD_FOLDER"main", SRC_FOLDER"main.c");
+        nob_cmd_append(&cmd, "-lraylib", "-lGL", "-lm", "-lpthread", "-ldl", "-lrt", "-lX11");
+        if (!nob_cmd_run_sync_and_reset(&cmd)) return 1;
+      } else if (strcmp(param, "check") == 0) {
+        // Renders the scripts in tests/ in batch mode and compares the results, see check().
+        nob_cmd_append(&cmd, "cc", "-ggdb", "-O2", "-Wall", "-Wextra", "-ffp-contract=off", "-o", BUILD_FOLDER"main", SRC_FOLDER"main.c");
+        nob_cmd_append(&cmd, "-lraylib", "-lGL", "-lm", "-lpthread", "-ldl", "-lrt", "-lX11");
+        if (!nob_cmd_run_sync_and_reset(&cmd)) return 1;
+        if (!check(&cmd)) return 1;
       }
     }
 
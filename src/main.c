@@ -1,10 +1,69 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdarg.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "raylib.h"
 #include "raymath.h"
 
+#ifdef TURTLE_ALLOC_STATS
+// Counts the heap calls made from this file, nob.h and stb_ds.h (raylib's
+// own are out of reach), so the hot paths can be checked to allocate nothing.
+// Per thread, so the render loop and the interpreter each check their own.
+static _Thread_local size_t AllocCalls;
+static _Thread_local size_t FreeCalls;
+
+void* CountingMalloc(size_t size) {
+  AllocCalls++;
+  return malloc(size);
+}
+
+void* CountingCalloc(size_t count, size_t size) {
+  AllocCalls++;
+  return calloc(count, size);
+}
+
+void* CountingRealloc(void* ptr, size_t size) {
+  AllocCalls++;
+  return realloc(ptr, size);
+}
+
+void CountingFree(void* ptr) {
+  if (ptr != NULL)
+    FreeCalls++;
+  free(ptr);
+}
+
+#define malloc(size) CountingMalloc(size)
+#define calloc(count, size) CountingCalloc(count, size)
+#define realloc(ptr, size) CountingRealloc(ptr, size)
+#define free(ptr) CountingFree(ptr)
+
+// Heap calls made by GROWTH statements: containers growing past their largest
+// size so far, or a cache being rebuilt. CheckAllocs excuses exactly these,
+// so one legitimate grow can't hide an unrelated allocation. Nested GROWTHs
+// count each heap call once.
+static _Thread_local size_t GrowthCalls;
+
+#define GROWTH(stmt) do { \
+    size_t heapMark_ = AllocCalls + FreeCalls, growthMark_ = GrowthCalls; \
+    stmt; \
+    GrowthCalls = growthMark_ + (AllocCalls + FreeCalls - heapMark_); \
+  } while (0)
+#else
+#define GROWTH(stmt) do { stmt; } while (0)
+#endif
+
 #define STB_DS_IMPLEMENTATION
 #include "../third-party/stb/stb_ds.h"
 
@@ -33,11 +92,45 @@ typedef struct {
   Color color;
 } TLine;
 
+// Vertices drawn as one connected strip in a single style. Consecutive pen
+// down moves share a polyline as long as they connect and keep the same
+// pen, so polylines double as the run-length encoding of color and thickness.
 typedef struct {
-  TLine* items;
-  size_t capacity;
+  uint32_t first;      // index of the polyline's first vertex
+  Color color;
+  uint16_t thickness;  // in 1/LINE_THICKNESS_SCALE pixels
+} Polyline;
+
+#define LINE_THICKNESS_SCALE 16
+
+typedef struct {
+  Polyline* items;
   size_t count;
-} TLines;
+  size_t capacity;
+} Polylines;
+
+// Structure of arrays line storage. A connected line costs one vertex
+// (8 bytes) instead of a whole TLine (28 bytes); a line that starts a new
+// polyline costs two vertices and a Polyline, 28 bytes again. So only
+// connected runs in one pen get smaller: pen up jumps, style changes and
+// swarm members, whose moves rarely connect, cost what they used to.
+typedef struct {
+  float* xs;
+  float* ys;
+  size_t count;     // vertices
+  size_t capacity;
+  Polylines polylines;
+  size_t lines;
+  size_t merges;  // lines that extended the previous one instead of adding a vertex
+  bool noMerge;   // keep every line as appended, for stores that are only passed on
+} LineStore;
+
+// Position of a line inside a LineStore: the line ends at vertex and starts
+// at vertex-1, both belonging to polylines.items[poly].
+typedef struct {
+  uint32_t poly;
+  uint32_t vertex;
+} LineRef;
 
 typedef struct {
   bool down;
@@ -45,14 +138,50 @@ typedef struct {
   int width;
 } Pen;
 
+// Angle in degrees that stays exact while it is a whole number of
+// millidegrees, so e.g. RP 360 [RT 1] lands back on exactly 0 and the same
+// program produces the same output on any machine.
+typedef struct {
+  int32_t milli;  // [0, MILLI_TURN), only meaningful when exact
+  float degrees;  // [0, 360), always valid
+  bool exact;
+} Angle;
+
+#define MILLI_TURN 360000
+
 typedef struct {
   Vector2 position;
-  float rotation;
+  Angle rotation;
+  Vector2 heading; // unit vector for rotation, only recomputed when turning
   float size;
   Pen pen;
-  TLines lines;
+  Color background;
+  LineStore lines;
+  size_t clears;  // bumped by CS so views of lines know to start over
 } Turtle;
 
+// Lines already rasterized into target. Only lines appended since the last
+// sync are drawn, so the frame cost doesn't grow with the drawing.
+typedef struct {
+  RenderTexture2D target;
+  size_t drawnPoly;      // polyline holding the last drawn vertex
+  size_t drawnVertices;  // vertices below this are on the canvas
+  size_t merges;         // LineStore.merges at the last sync
+  size_t clears;
+} Canvas;
+
+// Visible history rows rendered into target. They are only laid out again
+// when a command is added or the panel is scrolled.
+typedef struct {
+  RenderTexture2D target;
+  size_t scroll;        // rows scrolled back from the newest command
+  size_t drawnCounter;  // CmdHistory.counter at the last render
+  size_t drawnScroll;
+  bool drawn;
+} HistoryPanel;
+
+#define HISTORY_ROW_HEIGHT (INPUT_FONT_SIZE*0.6f)
+
 typedef enum {
   CMD_FD,
   CMD_BK,
@@ -65,6 +194,7 @@ typedef enum {
   CMD_SETPC,
   CMD_SETBG,
   CMD_RP,
+  CMD_SWARM,
   CMD_COUNT
 } Cmd;
 
@@ -72,7 +202,7 @@ typedef enum {
   CAT_NONE,
   CAT_INT,
   CAT_COLOR,
-  CAT_TEXT,
+  CAT_BLOCK,
   CAT_COUNT
 } CmdArgType;
 
@@ -80,27 +210,139 @@ typedef struct {
   const char* fullName;
   const char* shortName;
   Cmd cmd;
-  const char* arg;
   bool argRequired;
   CmdArgType argType;
 } TurtleCmd;
 
+// Command names are short, anything longer than this can't be a command.
+#define MAX_CMD_NAME_LEN 32
+
+typedef struct {
+  char* key;
+  size_t value;
+} CmdIndex;
+
 typedef struct {
   TurtleCmd* items;
   size_t count;
   size_t capacity;
+  CmdIndex* index;
 } TurtleCmds;
 
+// Compiled form of a command line. Operands are decoded once at compile time
+// so executing an instruction never has to look at the source text again.
+typedef enum {
+  OP_MOVE,    // FD/BK, as.amt is the signed distance
+  OP_TURN,    // LT/RT, as.amt is the signed angle in degrees, or as.milli with INSTR_EXACT_TURN
+  OP_HOME,
+  OP_CS,
+  OP_PD,
+  OP_PU,
+  OP_SETPC,
+  OP_SETBG,
+  OP_REPEAT,  // as.count iterations of the body, jump is the index of the matching OP_END
+  OP_END,     // jump is the index of the matching OP_REPEAT
+  OP_TRAVEL,  // pen-up move by as.d in the turtle's frame (x along the heading), only made by OptimizeProgram
+  OP_SWARM,   // as.count turtles run the body from the turtle's pose, jump is the index of the matching OP_END
+  OP_CALL,    // runs procedure as.count, its arguments are the OP_ARGs that follow
+  OP_ARG,     // argument of the OP_CALL before it, as.amt or an argument of the caller
+  OP_COUNT
+} OpCode;
+
+// OP_REPEAT whose body only moves, turns and changes pen state, so every
+// iteration applies the same transform to the turtle's pose.
+#define INSTR_CLOSED_FORM 0x1
+// OP_TURN by a whole number of millidegrees, stored in as.milli.
+#define INSTR_EXACT_TURN 0x2
+// First OP_MOVE/OP_TURN of a run of them, jump is one past the run's last
+// instruction. The whole run executes at once in RunMoveRun.
+#define INSTR_MOVE_RUN 0x4
+// The operand (amount, angle, repeat count or call argument) is as.arg.sign
+// times an argument of the running procedure, only known when it runs.
+// Nothing folds or batches these.
+#define INSTR_ARG 0x8
+
 typedef struct {
-  Nob_String_View text;
-  Color color;
-} CmdHistoryEntry;
+  OpCode op;
+  uint32_t flags;
+  uint32_t jump;
+  union {
+    float amt;
+    int32_t milli;
+    Color color;
+    uint32_t count;
+    Vector2 d;
+    struct {
+      uint32_t slot;
+      float sign;
+    } arg;
+  } as;
+} Instr;
+
+typedef struct {
+  Instr* items;
+  size_t count;
+  size_t capacity;
+  size_t depth;  // deepest OP_REPEAT nesting, the called procedures' included, sizes the loop stack
+  uint64_t steps;  // instructions a run executes, saturates at UINT64_MAX; repeat counts from arguments count as 1
+} Program;
+
+// Most arguments one procedure takes.
+#define PROC_ARGS_CAP 8
+// Longest chain of calls, checked when a procedure is defined.
+#define CALL_DEPTH_CAP 32
+
+// Procedure defined by TO name :arg ... END. Redefining a name adds a new
+// procedure and calls compiled earlier keep the old one, so calls never form
+// a cycle. The old one's slot is reused once nothing calls it any more.
+typedef struct {
+  char name[MAX_CMD_NAME_LEN];  // upper-cased
+  size_t arity;
+  Program body;
+  size_t calls;         // longest chain of calls starting with this one
+  bool cacheable;       // only moves relative to where it's called, see CallGeometry
+  size_t callers;       // OP_CALLs to it in defined procedures' bodies
+  uint32_t generation;  // bumped when the slot is freed, keeps cached calls apart
+} Procedure;
 
+// Slot numbers in Procs.items.
 typedef struct {
-  CmdHistoryEntry* items;
+  size_t* items;
   size_t count;
   size_t capacity;
-  size_t counter;
+} ProcSlots;
+
+// A program's definitions only take effect once all of it compiled. Until
+// then they are pending, and a failed program gives their slots back. Free
+// slots keep their bodies' buffers for the next definitions, so neither a
+// failed TO nor redefining a procedure over and over goes back to the heap.
+typedef struct {
+  Procedure* items;
+  size_t count;          // slots
+  size_t capacity;
+  ProcSlots free;        // slots without a procedure
+  ProcSlots pending;     // the compiling program's definitions, oldest first
+  ProcSlots superseded;  // procedures a newer one of the same name replaced
+  CmdIndex* index;       // upper-cased name to the newest procedure of that name
+} Procedures;
+
+static Procedures Procs = {0};
+
+// Commands as typed, formatted only when a row is drawn.
+typedef struct {
+  char text[MAX_INPUT_CHARS_COUNT];
+  uint8_t len;
+  const char* error;  // static message from the compiler, "" on success
+} CmdHistoryEntry;
+
+// More than fit on the screen, older commands are overwritten.
+#define HISTORY_CAP 128
+
+// Ring of the last HISTORY_CAP commands, command n is at items[n % HISTORY_CAP].
+typedef struct {
+  CmdHistoryEntry items[HISTORY_CAP];
+  size_t count;
+  size_t counter;  // commands entered so far, the next command's number
 } CmdHistory;
 
 typedef struct {
@@ -108,13 +350,129 @@ typedef struct {
   Color color;
 } ColorItem;
 
-char* ucase(const char *str) {
+// Bump allocator over a chain of blocks. Nothing is freed on its own, the
+// whole arena is reset at once and its blocks are reused, so an arena that
+// is reset regularly stops calling malloc once it has grown to its peak.
+typedef struct ArenaBlock {
+  struct ArenaBlock* next;
+  size_t size;
+  size_t capacity;
+  _Alignas(16) char data[];
+} ArenaBlock;
+
+typedef struct {
+  ArenaBlock* first;
+  ArenaBlock* current;
+} Arena;
+
+#define ARENA_BLOCK_SIZE (64*1024)
+
+void* ArenaAlloc(Arena* a, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  ArenaBlock* b = a->current;
+  while (b != NULL && b->size + size > b->capacity)
+    b = b->next;
+  if (b == NULL) {
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    GROWTH(b = malloc(sizeof(ArenaBlock) + capacity));
+    NOB_ASSERT(b != NULL && "Buy more RAM lol");
+    *b = (ArenaBlock) { .capacity = capacity };
+    // New blocks go after the current one, blocks skipped on the way stay
+    // in the chain for the next reset.
+    if (a->current == NULL) {
+      a->first = b;
+    } else {
+      b->next = a->current->next;
+      a->current->next = b;
+    }
+  }
+  a->current = b;
+  void* result = b->data + b->size;
+  b->size += size;
+  return result;
+}
+
+void ArenaReset(Arena* a) {
+  for (ArenaBlock* b = a->first; b != NULL; b = b->next)
+    b->size = 0;
+  a->current = a->first;
+}
+
+void ArenaFree(Arena* a) {
+  ArenaBlock* b = a->first;
+  while (b != NULL) {
+    ArenaBlock* next = b->next;
+    free(b);
+    b = next;
+  }
+  *a = (Arena) {0};
+}
+
+char* ArenaSvToCstr(Arena* a, Nob_String_View sv) {
+  char* result = ArenaAlloc(a, sv.count + 1);
+  memcpy(result, sv.data, sv.count);
+  result[sv.count] = '\0';
+  return result;
+}
+
+char* ArenaSprintf(Arena* a, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  NOB_ASSERT(n >= 0);
+  char* result = ArenaAlloc(a, n + 1);
+  va_start(args, format);
+  vsnprintf(result, n + 1, format, args);
+  va_end(args);
+  return result;
+}
+
+// Reset after every command line (or script in batch mode): executing it.
+// In the window only the interpreter thread uses it. The history is a fixed
+// ring in CmdHistory, so nothing needs a session-long arena.
+static Arena CommandArena = {0};
+// Reset after every frame: strings handed to raylib for drawing.
+static Arena FrameArena = {0};
+
+// Snapshot for CheckAllocs.
+typedef struct {
+  size_t allocs;
+  size_t frees;
+  size_t grown;  // heap calls made by GROWTH
+} AllocMark;
+
+AllocMark MarkAllocs(void) {
+#ifdef TURTLE_ALLOC_STATS
+  AllocMark m = { AllocCalls, FreeCalls, GrowthCalls };
+#else
+  AllocMark m = {0};
+#endif
+  return m;
+}
+
+// Reports the heap calls since mark, and in TURTLE_ALLOC_STATS builds asserts
+// every one of them was made by GROWTH: once warmed up the frame loop and the
+// command executor must not allocate.
+void CheckAllocs(const char* what, AllocMark mark, bool always) {
+#ifdef TURTLE_ALLOC_STATS
+  size_t allocs = AllocCalls - mark.allocs;
+  size_t frees = FreeCalls - mark.frees;
+  size_t grown = GrowthCalls - mark.grown;
+  if (always || allocs > 0 || frees > 0)
+    nob_log(NOB_INFO, "%s: %zu allocations, %zu frees%s", what, allocs, frees, grown > 0 ? " (grew)" : "");
+  NOB_ASSERT(allocs + frees == grown && "heap allocation on the hot path");
+#else
+  NOB_UNUSED(what);
+  NOB_UNUSED(mark);
+  NOB_UNUSED(always);
+#endif
+}
+
+char* ucase(Arena* arena, const char *str) {
   // Allocate memory for the new string
   size_t len = strlen(str);
-  char *upperStr = (char *)malloc(len + 1); // +1 for the null terminator
-  if (upperStr == NULL) {
-      return NULL; // Handle memory allocation failure
-  }
+  char *upperStr = ArenaAlloc(arena, len + 1); // +1 for the null terminator
 
   // Convert to uppercase
   for (size_t i = 0; i < len; i++) {
@@ -125,86 +483,322 @@ char* ucase(const char *str) {
   return upperStr; // Return the new string
 }
 
-typedef struct {
-  ColorItem *items;
-  size_t capacity;
-  size_t count;
-} Colors;
-
-Colors GetColors() {
-  Colors colors = {0};
-  nob_da_append(&colors, ((ColorItem) { "LIGHTGRAY", LIGHTGRAY}));
-  nob_da_append(&colors, ((ColorItem) { "GRAY", GRAY }));
-  nob_da_append(&colors, ((ColorItem) { "DARKGRAY", DARKGRAY }));
-  nob_da_append(&colors, ((ColorItem) { "YELLOW", YELLOW })); 
-  nob_da_append(&colors, ((ColorItem) { "GOLD", GOLD }));
-  nob_da_append(&colors, ((ColorItem) { "ORANGE", ORANGE }));
-  nob_da_append(&colors, ((ColorItem) { "PINK", PINK }));
-  nob_da_append(&colors, ((ColorItem) { "RED", RED }));
-  nob_da_append(&colors, ((ColorItem) { "MAROON", MAROON }));
-  nob_da_append(&colors, ((ColorItem) { "GREEN", GREEN }));
-  nob_da_append(&colors, ((ColorItem) { "LIME", LIME }));
-  nob_da_append(&colors, ((ColorItem) { "DARKGREEN", DARKGREEN }));
-  nob_da_append(&colors, ((ColorItem) { "SKYBLUE", SKYBLUE }));
-  nob_da_append(&colors, ((ColorItem) { "BLUE", BLUE }));
-  nob_da_append(&colors, ((ColorItem) { "DARKBLUE", DARKBLUE }));
-  nob_da_append(&colors, ((ColorItem) { "PURPLE", PURPLE }));
-  nob_da_append(&colors, ((ColorItem) { "VIOLET", VIOLET }));
-  nob_da_append(&colors, ((ColorItem) { "DARKPURPLE", DARKPURPLE }));
-  nob_da_append(&colors, ((ColorItem) { "BEIGE", BEIGE }));
-  nob_da_append(&colors, ((ColorItem) { "BROWN", BROWN }));
-  nob_da_append(&colors, ((ColorItem) { "DARKBROWN", DARKBROWN }));
-  nob_da_append(&colors, ((ColorItem) { "WHITE", WHITE }));
-  nob_da_append(&colors, ((ColorItem) { "BLACK", BLACK }));
-  nob_da_append(&colors, ((ColorItem) { "BLANK", BLANK }));
-  nob_da_append(&colors, ((ColorItem) { "MAGENTA", MAGENTA }));
-  nob_da_append(&colors, ((ColorItem) { "RAYWHITE", RAYWHITE }));
-  return colors;
-}
-
-Color LookupColor(const char* value) {
-  Colors colors = GetColors();
-  value = ucase(value);
-  for (size_t i = 0; i < colors.count; ++i) {
-    if (strcmp(colors.items[i].name, value) == 0)
-        return colors.items[i].color;
+static const ColorItem Colors[] = {
+  { "LIGHTGRAY", LIGHTGRAY },
+  { "GRAY", GRAY },
+  { "DARKGRAY", DARKGRAY },
+  { "YELLOW", YELLOW },
+  { "GOLD", GOLD },
+  { "ORANGE", ORANGE },
+  { "PINK", PINK },
+  { "RED", RED },
+  { "MAROON", MAROON },
+  { "GREEN", GREEN },
+  { "LIME", LIME },
+  { "DARKGREEN", DARKGREEN },
+  { "SKYBLUE", SKYBLUE },
+  { "BLUE", BLUE },
+  { "DARKBLUE", DARKBLUE },
+  { "PURPLE", PURPLE },
+  { "VIOLET", VIOLET },
+  { "DARKPURPLE", DARKPURPLE },
+  { "BEIGE", BEIGE },
+  { "BROWN", BROWN },
+  { "DARKBROWN", DARKBROWN },
+  { "WHITE", WHITE },
+  { "BLACK", BLACK },
+  { "BLANK", BLANK },
+  { "MAGENTA", MAGENTA },
+  { "RAYWHITE", RAYWHITE },
+};
+
+// Open addressing index into Colors. Slots hold index+1 so zero means empty.
+// Must be a power of two and comfortably larger than the number of colors.
+// Filled by InitColorIndex at startup.
+#define COLOR_INDEX_CAP 64
+static unsigned char ColorIndex[COLOR_INDEX_CAP];
+
+// FNV-1a over the upper-cased name, so lookups are case-insensitive.
+uint32_t HashColorName(Nob_String_View name) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < name.count; ++i) {
+    h ^= (unsigned char)toupper((unsigned char)name.data[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+bool ColorNameEq(const char* name, Nob_String_View sv) {
+  size_t i = 0;
+  for (; i < sv.count; ++i) {
+    if (name[i] == '\0' || name[i] != toupper((unsigned char)sv.data[i]))
+      return false;
+  }
+  return name[i] == '\0';
+}
+
+void InitColorIndex(void) {
+  for (size_t i = 0; i < NOB_ARRAY_LEN(Colors); ++i) {
+    uint32_t slot = HashColorName(nob_sv_from_cstr(Colors[i].name)) & (COLOR_INDEX_CAP - 1);
+    while (ColorIndex[slot] != 0)
+      slot = (slot + 1) & (COLOR_INDEX_CAP - 1);
+    ColorIndex[slot] = (unsigned char)(i + 1);
+  }
+}
+
+Color LookupColor(Nob_String_View value) {
+  uint32_t slot = HashColorName(value) & (COLOR_INDEX_CAP - 1);
+  while (ColorIndex[slot] != 0) {
+    const ColorItem* item = &Colors[ColorIndex[slot] - 1];
+    if (ColorNameEq(item->name, value))
+      return item->color;
+    slot = (slot + 1) & (COLOR_INDEX_CAP - 1);
   }
   return ColorAlpha(WHITE, 0);
 }
 
-CmdHistoryEntry CreateCmdHistoryEntry(size_t count, Nob_String_View sv, const char* errorMsg) {
+void PushCmdHistory(CmdHistory* history, Nob_String_View sv, const char* errorMsg) {
+  CmdHistoryEntry* ch = &history->items[history->counter++ % HISTORY_CAP];
+  ch->len = sv.count < sizeof(ch->text) ? sv.count : sizeof(ch->text);
+  memcpy(ch->text, sv.data, ch->len);
+  ch->error = errorMsg;
+  if (history->count < HISTORY_CAP)
+    history->count++;
+}
+
+// The i-th newest command, 0 being the last one entered.
+const CmdHistoryEntry* GetCmdHistory(const CmdHistory* history, size_t i, size_t* number) {
+  *number = history->counter - 1 - i;
+  return &history->items[*number % HISTORY_CAP];
+}
+
+// The row drawn for command number count.
+char* FormatCmdHistoryEntry(Arena* arena, size_t count, const CmdHistoryEntry* ch) {
   char countStr[3];
   snprintf(countStr, sizeof(countStr), "%02lx", count);
-  Nob_String_Builder nsb = {0};
-  nob_sb_appendf(&nsb, "%s: %s", countStr, ucase(nob_temp_sv_to_cstr(sv)));
-  Color color = WHITE;
-  bool hasError = strlen(errorMsg) > 0;
-  if (hasError) {
-    color = RED;
-    nob_sb_appendf(&nsb, ": %s", errorMsg);
-  }
-  Nob_String_View nsv = nob_sb_to_sv(nsb);
-  CmdHistoryEntry ch = { nsv, color };
-  return ch;
+  const char* upper = ucase(arena, ArenaSvToCstr(arena, nob_sv_from_parts(ch->text, ch->len)));
+  if (strlen(ch->error) > 0)
+    return ArenaSprintf(arena, "%s: %s: %s", countStr, upper, ch->error);
+  return ArenaSprintf(arena, "%s: %s", countStr, upper);
 }
 
 float d2r(float degrees) {
   return degrees * (PI / 180.0f);
 }
 
-Vector2 GetEnd(Vector2 v, float r, float len) {
+// sin of every millidegree in the first quadrant; the other quadrants and cos
+// follow by symmetry. Built at startup in double precision, with exact quarter turns.
+#define MILLI_QUARTER (MILLI_TURN / 4)
+static float MilliSines[MILLI_QUARTER + 1];
+
+void InitMilliSines(void) {
+  for (int m = 0; m <= MILLI_QUARTER; ++m)
+    MilliSines[m] = (float)sin(m * (3.14159265358979323846 / 180000.0));
+  MilliSines[0] = 0;
+  MilliSines[MILLI_QUARTER] = 1;
+}
+
+float SinMilli(int32_t m) {
+  int32_t r = m % MILLI_QUARTER;
+  switch (m / MILLI_QUARTER) {
+    case 0:  return MilliSines[r];
+    case 1:  return MilliSines[MILLI_QUARTER - r];
+    case 2:  return -MilliSines[r];
+    default: return -MilliSines[MILLI_QUARTER - r];
+  }
+}
+
+float NormalizeDegrees(float degrees) {
+  degrees = fmodf(degrees, 360.0f);
+  if (degrees < 0)
+    degrees += 360.0f;
+  return degrees < 360.0f ? degrees : 0.0f;
+}
+
+Angle AngleFromMilli(int64_t milli) {
+  milli %= MILLI_TURN;
+  if (milli < 0)
+    milli += MILLI_TURN;
+  Angle a = { .milli = (int32_t)milli, .degrees = milli / 1000.0f, .exact = true };
+  return a;
+}
+
+// Snaps to millidegrees when degrees is one up to float precision, so 0.1f
+// still counts as exactly 100 millidegrees.
+Angle AngleFromDegrees(float degrees) {
+  double milli = (double)degrees * 1000.0;
+  double whole = round(milli);
+  if (fabs(milli - whole) <= fabs(milli) * 1e-7 && fabs(whole) < 1e15)
+    return AngleFromMilli((int64_t)whole);
+  Angle a = { .degrees = NormalizeDegrees(degrees), .exact = false };
+  return a;
+}
+
+Angle AddAngles(Angle a, Angle b) {
+  if (a.exact && b.exact)
+    return AngleFromMilli((int64_t)a.milli + b.milli);
+  Angle r = { .degrees = NormalizeDegrees(a.degrees + b.degrees), .exact = false };
+  return r;
+}
+
+Angle NegateAngle(Angle a) {
+  if (a.exact)
+    return AngleFromMilli(-(int64_t)a.milli);
+  Angle r = { .degrees = NormalizeDegrees(-a.degrees), .exact = false };
+  return r;
+}
+
+Vector2 HeadingVector(Angle a) {
+  if (a.exact)
+    return (Vector2) { SinMilli((a.milli + MILLI_QUARTER) % MILLI_TURN), SinMilli(a.milli) };
+  float r = d2r(a.degrees);
+  return (Vector2) { cosf(r), sinf(r) };
+}
+
+void TurnTurtle(Turtle* t, Angle delta) {
+  t->rotation = AddAngles(t->rotation, delta);
+  t->heading = HeadingVector(t->rotation);
+}
+
+Vector2 GetEnd(Vector2 v, Vector2 dir, float len) {
   Vector2 end = (Vector2) {
-    .x = v.x + len * cosf(r),
-    .y = v.y + len * sinf(r)
+    .x = v.x + len * dir.x,
+    .y = v.y + len * dir.y
   };
   return end;
 }
 
+bool ColorEq(Color a, Color b) {
+  return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+uint16_t QuantizeThickness(float thickness) {
+  float q = roundf(thickness * LINE_THICKNESS_SCALE);
+  return q < 0 ? 0 : q > UINT16_MAX ? UINT16_MAX : (uint16_t)q;
+}
+
+// Makes room for n more vertices up front, so bulk appends grow the arrays once.
+void ReserveVertices(LineStore* s, size_t n) {
+  if (s->count + n <= s->capacity)
+    return;
+  if (s->capacity == 0)
+    s->capacity = NOB_DA_INIT_CAP;
+  while (s->count + n > s->capacity)
+    s->capacity *= 2;
+  GROWTH(s->xs = NOB_REALLOC(s->xs, s->capacity * sizeof(*s->xs)));
+  GROWTH(s->ys = NOB_REALLOC(s->ys, s->capacity * sizeof(*s->ys)));
+  NOB_ASSERT(s->xs != NULL && s->ys != NULL && "Buy more RAM lol");
+}
+
+void PushVertex(LineStore* s, Vector2 v) {
+  ReserveVertices(s, 1);
+  s->xs[s->count] = v.x;
+  s->ys[s->count] = v.y;
+  s->count++;
+}
+
+// How far in pixels a dropped vertex may be from the merged line.
+#define LINE_MERGE_EPSILON 1e-3f
+
+void AppendLine(LineStore* s, Vector2 start, Vector2 end, float thickness, Color color) {
+  uint16_t q = QuantizeThickness(thickness);
+  bool extends = false;
+  if (s->polylines.count > 0) {
+    Polyline last = nob_da_last(&s->polylines);
+    extends = last.thickness == q
+           && ColorEq(last.color, color)
+           && s->xs[s->count-1] == start.x && s->ys[s->count-1] == start.y;
+  }
+  if (!extends) {
+    Polyline poly = { .first = s->count, .color = color, .thickness = q };
+    GROWTH(nob_da_append(&s->polylines, poly));
+    PushVertex(s, start);
+  } else if (!s->noMerge && s->count - nob_da_last(&s->polylines).first >= 2) {
+    // Step-wise programs like RP 1000 [FD 1] produce long collinear chains,
+    // move the last vertex instead of adding one when the new line continues
+    // the last in the same direction.
+    Vector2 prev = { s->xs[s->count-2], s->ys[s->count-2] };
+    Vector2 a = { start.x - prev.x, start.y - prev.y };
+    Vector2 b = { end.x - prev.x, end.y - prev.y };
+    float cross = a.x*b.y - a.y*b.x;
+    float dot = a.x*(end.x - start.x) + a.y*(end.y - start.y);
+    float lenB = sqrtf(b.x*b.x + b.y*b.y);
+    if (dot > 0 && fabsf(cross) <= LINE_MERGE_EPSILON * lenB) {
+      s->xs[s->count-1] = end.x;
+      s->ys[s->count-1] = end.y;
+      s->merges++;
+      return;
+    }
+  }
+  PushVertex(s, end);
+  s->lines++;
+}
+
+void ClearLineStore(LineStore* s) {
+  s->count = 0;
+  s->polylines.count = 0;
+  s->lines = 0;
+  s->merges = 0;
+}
+
+void FreeLineStore(LineStore* s) {
+  NOB_FREE(s->xs);
+  NOB_FREE(s->ys);
+  nob_da_free(s->polylines);
+  *s = (LineStore) {0};
+}
+
+// One past the last vertex of polyline p.
+size_t PolylineEnd(const LineStore* s, size_t p) {
+  return p + 1 < s->polylines.count ? s->polylines.items[p + 1].first : s->count;
+}
+
+float PolylineThickness(Polyline poly) {
+  return (float)poly.thickness / LINE_THICKNESS_SCALE;
+}
+
+// Appends the lines of src to s in order, one AppendLine each.
+void AppendLines(LineStore* s, const LineStore* src) {
+  for (size_t p = 0; p < src->polylines.count; ++p) {
+    Polyline poly = src->polylines.items[p];
+    float thickness = PolylineThickness(poly);
+    size_t end = PolylineEnd(src, p);
+    for (size_t v = poly.first + 1; v < end; ++v)
+      AppendLine(s, (Vector2) { src->xs[v-1], src->ys[v-1] }, (Vector2) { src->xs[v], src->ys[v] }, thickness, poly.color);
+  }
+}
+
+TLine GetLine(const LineStore* s, LineRef ref) {
+  Polyline poly = s->polylines.items[ref.poly];
+  TLine line = {
+    .start = { s->xs[ref.vertex-1], s->ys[ref.vertex-1] },
+    .end = { s->xs[ref.vertex], s->ys[ref.vertex] },
+    .thickness = PolylineThickness(poly),
+    .color = poly.color,
+  };
+  return line;
+}
+
+// Walks the lines of a store in order. Start from a zeroed cursor; the
+// cursor stays valid across appends, so it can resume where it left off.
+bool NextLine(const LineStore* s, LineRef* cursor) {
+  for (;;) {
+    if ((size_t)cursor->vertex + 1 >= s->count)
+      return false;
+    cursor->vertex++;
+    while ((size_t)cursor->poly + 1 < s->polylines.count && s->polylines.items[cursor->poly + 1].first <= cursor->vertex)
+      cursor->poly++;
+    // The first vertex of a polyline only starts a line.
+    if (s->polylines.items[cursor->poly].first != cursor->vertex)
+      return true;
+  }
+}
+
 void DrawTurtle(Turtle t, Font font) {
   DrawCircleV(t.position, t.size, t.pen.color);
-  Vector2 end = GetEnd(t.position, t.rotation, t.size/2);
+  Vector2 end = GetEnd(t.position, t.heading, t.size/2);
   DrawCircleV(end, t.size/2, ORANGE);
-  DrawCircleV(GetEnd(t.position, t.rotation, t.size*0.8), t.size/6, BLACK);
+  DrawCircleV(GetEnd(t.position, t.heading, t.size*0.8), t.size/6, BLACK);
   DrawCircleV(t.position, t.size/8, BLACK);
   const char* text = t.pen.down ? "PD" : "PU";
   int fontSize = 12;
@@ -213,231 +807,2913 @@ void DrawTurtle(Turtle t, Font font) {
   DrawTextEx(font, text, c, fontSize, 1, WHITE);
 }
 
+// Upper-cases sv into buf without allocating. Returns false if it doesn't fit.
+bool UcaseInto(char* buf, size_t cap, Nob_String_View sv) {
+  if (sv.count >= cap)
+    return false;
+  for (size_t i = 0; i < sv.count; ++i) {
+    buf[i] = toupper((unsigned char)sv.data[i]);
+  }
+  buf[sv.count] = '\0';
+  return true;
+}
+
 void InsertCmd(TurtleCmds *cmds, const char* fullName, const char* shortName, bool argRequired, Cmd cmd, CmdArgType catType) {
-  TurtleCmd tc = { fullName, shortName, cmd, NULL, argRequired, catType };
+  TurtleCmd tc = { fullName, shortName, cmd, argRequired, catType };
   nob_da_append(cmds, tc);
+
+  // The index stores upper-cased names so lookups only have to upper-case the input.
+  // Values are indices rather than pointers since nob_da_append may move items.
+  if (cmds->index == NULL)
+    sh_new_strdup(cmds->index);
+  char key[MAX_CMD_NAME_LEN];
+  bool fits = UcaseInto(key, sizeof(key), nob_sv_from_cstr(fullName));
+  NOB_ASSERT(fits && "Increase MAX_CMD_NAME_LEN");
+  shput(cmds->index, key, cmds->count - 1);
+  fits = UcaseInto(key, sizeof(key), nob_sv_from_cstr(shortName));
+  NOB_ASSERT(fits && "Increase MAX_CMD_NAME_LEN");
+  shput(cmds->index, key, cmds->count - 1);
 }
 
 TurtleCmd* GetCmd(TurtleCmds cmds, Nob_String_View cmdText) {
-  char* ct = ucase(nob_temp_sv_to_cstr(cmdText));
-  for (size_t i = 0; i < cmds.count; ++i) {
-    TurtleCmd cmd = cmds.items[i];
-    char* fn = ucase(cmd.fullName);
-    char* sn = ucase(cmd.shortName);
-    if (strcmp(ct, ucase(fn)) == 0 || strcmp(ct, ucase(sn)) == 0)
-        return &cmds.items[i];
+  char ct[MAX_CMD_NAME_LEN];
+  if (!UcaseInto(ct, sizeof(ct), cmdText))
+    return NULL;
+  ptrdiff_t i = shgeti(cmds.index, ct);
+  if (i < 0)
+    return NULL;
+  return &cmds.items[cmds.index[i].value];
+}
+
+// Splits off the next token. Brackets are always tokens on their own so
+// "RP 4 [FD 10 RT 90]" and "RP 4 [ FD 10 RT 90 ]" compile the same.
+Nob_String_View NextToken(Nob_String_View* src) {
+  *src = nob_sv_trim_left(*src);
+  size_t n = 0;
+  if (src->count > 0 && (src->data[0] == '[' || src->data[0] == ']')) {
+    n = 1;
+  } else {
+    while (n < src->count && !isspace((unsigned char)src->data[n]) && src->data[n] != '[' && src->data[n] != ']')
+      n++;
   }
-  return NULL;
+  return nob_sv_chop_left(src, n);
 }
 
-bool ValidateArg(TurtleCmd* cmd) {
-  float amt = 0;
-  Color color = WHITE;
-  Nob_String_Builder sb = {0};
-  if (cmd->argType == CAT_INT) {
-    amt = atof(cmd->arg);
-    if (amt == 0.0f)
-      return false;
-  } else if (cmd->argType == CAT_COLOR) {
-    color = LookupColor(cmd->arg);
-    if (color.a == 0)
-      return false;
-  } else if (cmd->argType == CAT_TEXT) {
-    if (!nob_sb_appendf(&sb, "%s", cmd->arg)) {
+bool ParseNumber(Nob_String_View sv, float* out) {
+  char buf[64];
+  if (sv.count == 0 || sv.count >= sizeof(buf))
+    return false;
+  memcpy(buf, sv.data, sv.count);
+  buf[sv.count] = '\0';
+  char* end = NULL;
+  *out = strtof(buf, &end);
+  // strtof takes inf and nan, and overflows to inf, none of which draw.
+  return *end == '\0' && isfinite(*out);
+}
+
+// Parses a decimal angle into millidegrees reduced to [0, MILLI_TURN).
+// Fails for angles with more than three decimals, which stay floats.
+bool ParseMilli(Nob_String_View sv, bool negate, int32_t* out) {
+  char buf[64];
+  if (sv.count == 0 || sv.count >= sizeof(buf))
+    return false;
+  memcpy(buf, sv.data, sv.count);
+  buf[sv.count] = '\0';
+  char* end = NULL;
+  double milli = strtod(buf, &end) * 1000.0;
+  double whole = round(milli);
+  if (*end != '\0' || fabs(milli - whole) > 1e-6 || fabs(whole) > 1e15)
+    return false;
+  *out = AngleFromMilli((int64_t)(negate ? -whole : whole)).milli;
+  return true;
+}
+
+// Most turtles one SWARM may run, which bounds its scratch memory.
+#define SWARM_CAP 100000
+
+typedef struct {
+  Nob_String_View src;
+  TurtleCmds* cmds;
+  Program* prog;
+  size_t depth;
+  bool inSwarm;  // compiling a SWARM body, which can't clear the screen, swarm again or call
+  Nob_String_View params[PROC_ARGS_CAP];  // of the procedure being defined
+  size_t arity;
+  size_t calls;    // longest chain of calls made from prog
+  bool cacheable;  // prog only moves relative to where it starts
+  const char* error;
+  Nob_String_View errorToken;
+} Compiler;
+
+// Programs are compiled into reused buffers, which only grow for a program
+// longer than any before.
+void Emit(Compiler* c, Instr in) {
+  GROWTH(nob_da_append(c->prog, in));
+}
+
+bool CompileError(Compiler* c, const char* error, Nob_String_View token) {
+  c->error = error;
+  c->errorToken = token;
+  return false;
+}
+
+// Case insensitive keyword match.
+bool TokenIs(Nob_String_View tok, const char* keyword) {
+  size_t n = strlen(keyword);
+  if (tok.count != n)
+    return false;
+  for (size_t i = 0; i < n; ++i) {
+    if (toupper((unsigned char)tok.data[i]) != keyword[i])
       return false;
-    }
   }
   return true;
 }
 
-bool UpdateTurtle(Turtle* t, TurtleCmd* cmd, TurtleCmds commands) {
-  float amt = 0;
-  Color color = WHITE;
-  Nob_String_Builder sb = {0};
-  if (cmd->argType == CAT_INT) {
-    amt = atof(cmd->arg);
-    if (amt == 0.0f)
-      return false;
-  } else if (cmd->argType == CAT_COLOR) {
-    color = LookupColor(cmd->arg);
-    if (color.a == 0)
-      return false;
-  } else if (cmd->argType == CAT_TEXT) {
-    if (!nob_sb_appendf(&sb, "%s", cmd->arg)) {
-      return false;
-    }
+// Index of the newest procedure called name, or -1.
+ptrdiff_t FindProcedure(Nob_String_View name) {
+  char key[MAX_CMD_NAME_LEN];
+  if (!UcaseInto(key, sizeof(key), name))
+    return -1;
+  for (size_t i = Procs.pending.count; i > 0; --i) {
+    size_t slot = Procs.pending.items[i - 1];
+    if (strcmp(Procs.items[slot].name, key) == 0)
+      return (ptrdiff_t)slot;
   }
+  if (Procs.index == NULL)
+    return -1;
+  ptrdiff_t i = shgeti(Procs.index, key);
+  return i < 0 ? -1 : (ptrdiff_t)Procs.index[i].value;
+}
 
-  switch (cmd->cmd) {
-    case CMD_H: t->position = (Vector2) { .x = SW / 2, .y = SH / 2 }; break;
-    case CMD_CS: break;
-    case CMD_SETBG: break;
-    case CMD_SETPC: t->pen.color = color; break;
-    case CMD_PD: t->pen.down = true; break;
-    case CMD_PU: t->pen.down = false; break;
-    case CMD_FD:
-    case CMD_BK: {
-      int size = cmd->cmd == CMD_FD ? amt : -amt; 
-      Vector2 end = GetEnd(t->position, t->rotation, size);
-      if (t->pen.down) {
-        TLine line = { .start = t->position, .end = end, .thickness = 5, .color = t->pen.color };
-        nob_da_append(&t->lines, line);
-      }
-      t->position = end;
-      break;
+// Adds delta to the callers of every procedure proc calls.
+void CountCallers(const Procedure* proc, int delta) {
+  for (size_t pc = 0; pc < proc->body.count; ++pc) {
+    if (proc->body.items[pc].op == OP_CALL)
+      Procs.items[proc->body.items[pc].as.count].callers += delta;
+  }
+}
+
+// Makes the definitions of the program just compiled callable by later ones.
+void CommitProcedures(void) {
+  if (Procs.pending.count > 0 && Procs.index == NULL)
+    GROWTH(sh_new_strdup(Procs.index));
+  for (size_t i = 0; i < Procs.pending.count; ++i) {
+    size_t slot = Procs.pending.items[i];
+    const Procedure* proc = &Procs.items[slot];
+    CountCallers(proc, 1);
+    ptrdiff_t old = shgeti(Procs.index, proc->name);
+    if (old >= 0)
+      GROWTH(nob_da_append(&Procs.superseded, Procs.index[old].value));
+    GROWTH(shput(Procs.index, proc->name, slot));
+  }
+  Procs.pending.count = 0;
+}
+
+// Drops the definitions of a program that failed to compile.
+void DropProcedures(void) {
+  for (size_t i = 0; i < Procs.pending.count; ++i)
+    GROWTH(nob_da_append(&Procs.free, Procs.pending.items[i]));
+  Procs.pending.count = 0;
+}
+
+// Frees the slots of superseded procedures that no defined procedure calls.
+// Only done before compiling a program: the last one isn't running any more,
+// and it's the only program that could still call them.
+void ReclaimProcedures(void) {
+  for (size_t i = 0; i < Procs.superseded.count;) {
+    size_t slot = Procs.superseded.items[i];
+    Procedure* proc = &Procs.items[slot];
+    if (proc->callers > 0) {
+      ++i;
+      continue;
     }
-    case CMD_LT: t->rotation -= d2r(amt); break;
-    case CMD_RT: t->rotation += d2r(amt); break;
-    case CMD_RP: {
-      Nob_String_View sv = nob_sv_from_cstr(cmd->arg);
-      Nob_String_View rpt = nob_sv_chop_by_delim(&sv, ' '); 
-      int rptCount = atoi(rpt.data);
-      if (rptCount == 0) {
-        nob_log(NOB_ERROR, "Invalid rptCount: "SV_Fmt, SV_Arg(rpt));
-        return false;
-      }
-      nob_log(NOB_INFO, "rptCount: %d", rptCount);
-      Nob_String_View next = nob_sv_chop_left(&sv, 1);
-      if (!nob_sv_eq(next, nob_sv_from_cstr("["))) {
-        nob_log(NOB_ERROR, "Invalid repeat start: "SV_Fmt, SV_Arg(next));
+    CountCallers(proc, -1);
+    proc->generation++;
+    Procs.superseded.items[i] = Procs.superseded.items[--Procs.superseded.count];
+    GROWTH(nob_da_append(&Procs.free, slot));
+    i = 0;  // what it called may have no callers left now
+  }
+}
+
+bool IsClosedFormBody(const Program* prog, size_t begin, size_t end) {
+  for (size_t pc = begin; pc < end; ++pc) {
+    if (prog->items[pc].flags & INSTR_ARG)
+      return false;
+    switch (prog->items[pc].op) {
+      case OP_MOVE:
+      case OP_TURN:
+      case OP_PD:
+      case OP_PU:
+      case OP_SETPC:
+      case OP_SETBG:
+      case OP_REPEAT:
+      case OP_END:
+      case OP_TRAVEL:
+        break;
+      default:
         return false;
-      }
-      TurtleCmds cmds = {0};
-      next = nob_sv_chop_by_delim(&sv, ' ');
-      TurtleCmd* tc = GetCmd(commands, next);
-      while (tc) {
-        if (!tc) {
-          nob_log(NOB_ERROR, "Invalid cmd: "SV_Fmt, SV_Arg(next));
-          return false;
-        }
-        if (tc->argRequired) {
-          next = nob_sv_chop_by_delim(&sv, ' ');
-          tc->arg = nob_temp_sv_to_cstr(next);
-          if (!ValidateArg(tc)) {
-            nob_log(NOB_ERROR, "Invalid arg: "SV_Fmt, SV_Arg(next));
-            return false;
-          }
-        }
-        nob_da_append(&cmds, *tc);
-        next = nob_sv_chop_by_delim(&sv, ' ');
-        if (nob_sv_eq(next, nob_sv_from_cstr("]"))) {
-          nob_log(NOB_INFO, "end of the rp!");
-          return true;
-        }
-        tc = GetCmd(commands, next);
-        nob_log(NOB_INFO, SV_Fmt, SV_Arg(sv));
-      }
-      for (int i = 0; i < rptCount; ++i) {
-        for (size_t c = 0; c < cmds.count; ++c) {
-          if (!UpdateTurtle(t, &cmds.items[i], commands)) {
-            return false;
-          }
-        }
-      }
-      return true;
-    } break;
-    case CMD_COUNT: break;
+    }
   }
   return true;
 }
 
-TurtleCmd* ParseCommandText(Nob_String_View cmdText, TurtleCmds commands, CmdHistory* history) {
-  Nob_String_View leftCmd = nob_sv_chop_by_delim(&cmdText, ' ');
-  TurtleCmd* tc = GetCmd(commands, leftCmd);
-  if (tc) {
-    if (tc->argRequired) {
-      if (cmdText.count == 0) {
-        nob_log(NOB_ERROR, "No argument provided: "SV_Fmt"???", SV_Arg(leftCmd));
-        CmdHistoryEntry ch = CreateCmdHistoryEntry(history->counter++, cmdText, "no arg");
-        nob_da_append(history, ch);
-        return NULL;
-      } else {
-        nob_log(NOB_INFO, SV_Fmt, SV_Arg(cmdText));
-        CmdHistoryEntry ch = CreateCmdHistoryEntry(history->counter++, cmdText, "");
-        nob_da_append(history, ch);
-        tc->arg = cmdText.data;
-        return tc;
+// Compiles a number, or :name for an argument of the procedure being defined,
+// into in's operand. Numbers are scaled by sign, arguments by sign at run time.
+bool CompileOperand(Compiler* c, Nob_String_View arg, float sign, Instr* in) {
+  if (arg.count > 0 && arg.data[0] == ':') {
+    Nob_String_View name = nob_sv_from_parts(arg.data + 1, arg.count - 1);
+    if (c->inSwarm)
+      return CompileError(c, "invalid in swarm", arg);
+    for (size_t i = 0; i < c->arity; ++i) {
+      if (nob_sv_eq(c->params[i], name)) {
+        in->flags |= INSTR_ARG;
+        in->as.arg.slot = (uint32_t)i;
+        in->as.arg.sign = sign;
+        return true;
       }
-    } else {
-      nob_log(NOB_INFO, SV_Fmt, SV_Arg(leftCmd));
-      tc->arg = NULL;
-      CmdHistoryEntry ch = CreateCmdHistoryEntry(history->counter++, cmdText, "");
-      nob_da_append(history, ch);
-      return tc;
     }
-  } else {
-    nob_log(NOB_ERROR, "Invalid cmd: "SV_Fmt, SV_Arg(leftCmd));
-    CmdHistoryEntry ch = CreateCmdHistoryEntry(history->counter++, cmdText, "invalid cmd");
-    nob_da_append(history, ch);
-    return NULL;
+    return CompileError(c, "invalid arg", arg);
   }
+  float value = 0;
+  if (!ParseNumber(arg, &value))
+    return CompileError(c, "invalid arg", arg);
+  in->as.amt = sign * value;
+  return true;
 }
 
-int main(void) {
-  InitWindow(SW, SH, "turtle");
+bool CompileBlock(Compiler* c, const char* close);
+void PrepareProgram(Program* prog);
 
-  Font space12 = LoadFontEx("./assets/fonts/spaceInputFontSize_Mono/spaceInputFontSizeMono-Regular.ttf", 12, NULL, 0);
-  SetTextureFilter(space12.texture, TEXTURE_FILTER_BILINEAR);
+// TO name :arg ... END, right after the TO. The body is compiled into a free
+// slot, which is only taken once all of it compiled.
+bool CompileProcedure(Compiler* c, Nob_String_View to) {
+  Nob_String_View name = NextToken(&c->src);
+  char key[MAX_CMD_NAME_LEN];
+  if (name.count == 0)
+    return CompileError(c, "no name", to);
+  if (!UcaseInto(key, sizeof(key), name) || !isalpha((unsigned char)name.data[0])
+      || GetCmd(*c->cmds, name) || TokenIs(name, "TO") || TokenIs(name, "END"))
+    return CompileError(c, "invalid name", name);
 
-  Font spaceInputFontSize = LoadFontEx("./assets/fonts/spaceInputFontSize_Mono/spaceInputFontSizeMono-Regular.ttf", INPUT_FONT_SIZE, NULL, 0);
-  SetTextureFilter(spaceInputFontSize.texture, TEXTURE_FILTER_BILINEAR);
-  
-  TurtleCmds cmds = {0};
-  InsertCmd(&cmds, "Forward", "FD", true, CMD_FD, CAT_INT);
-  InsertCmd(&cmds, "Back", "BK", true, CMD_BK, CAT_INT);
-  InsertCmd(&cmds, "Left", "LT", true, CMD_LT, CAT_INT);
-  InsertCmd(&cmds, "Right", "RT", true, CMD_RT, CAT_INT);
-  InsertCmd(&cmds, "ClearScreen", "CS", false, CMD_CS, CAT_NONE);
-  InsertCmd(&cmds, "Home", "H", false, CMD_H, CAT_NONE);
-  InsertCmd(&cmds, "PenDown", "PD", false, CMD_PD, CAT_NONE);
-  InsertCmd(&cmds, "PenUp", "PU", false, CMD_PU, CAT_NONE);
-  InsertCmd(&cmds, "SetPenColor", "SETPC", true, CMD_SETPC, CAT_COLOR);
-  InsertCmd(&cmds, "SetBackground", "SETBG", true, CMD_SETBG, CAT_COLOR);
-  InsertCmd(&cmds, "Repeat", "RP", true, CMD_RP, CAT_TEXT);
+  // Bodies can't define procedures, so proc stays put while this one compiles.
+  if (Procs.free.count == 0) {
+    GROWTH(nob_da_append(&Procs, ((Procedure) {0})));
+    GROWTH(nob_da_append(&Procs.free, Procs.count - 1));
+  }
+  size_t slot = Procs.free.items[Procs.free.count - 1];
+  Procedure* proc = &Procs.items[slot];
+  proc->body.count = 0;
+  proc->body.depth = 0;
+  Compiler body = { .src = c->src, .cmds = c->cmds, .prog = &proc->body, .cacheable = true };
+  for (;;) {
+    Nob_String_View rest = body.src;
+    Nob_String_View param = NextToken(&rest);
+    if (param.count < 2 || param.data[0] != ':')
+      break;
+    if (body.arity == PROC_ARGS_CAP)
+      return CompileError(c, "too many args", param);
+    body.params[body.arity++] = nob_sv_from_parts(param.data + 1, param.count - 1);
+    body.src = rest;
+  }
+  bool ok = CompileBlock(&body, "END");
+  c->src = body.src;
+  if (ok && body.calls + 1 > CALL_DEPTH_CAP)
+    ok = CompileError(&body, "calls too deep", name);
+  if (!ok)
+    return CompileError(c, body.error, body.errorToken);
 
-  TLines lines = {0};
+  PrepareProgram(&proc->body);
+  memcpy(proc->name, key, sizeof(key));
+  proc->arity = body.arity;
+  proc->calls = body.calls + 1;
+  proc->cacheable = body.cacheable;
+  proc->callers = 0;
+  Procs.free.count--;
+  GROWTH(nob_da_append(&Procs.pending, slot));
+  return true;
+}
 
-  Pen tpen = { 
-    .down = false,
+// A call to procedure index, right after its name.
+bool CompileCall(Compiler* c, size_t index, Nob_String_View name) {
+  if (c->inSwarm)
+    return CompileError(c, "invalid in swarm", name);
+  const Procedure* proc = &Procs.items[index];
+  Instr call = { .op = OP_CALL, .as.count = (uint32_t)index };
+  Emit(c, call);
+  for (size_t i = 0; i < proc->arity; ++i) {
+    Nob_String_View arg = NextToken(&c->src);
+    if (arg.count == 0)
+      return CompileError(c, "no arg", name);
+    Instr in = { .op = OP_ARG };
+    if (!CompileOperand(c, arg, 1, &in))
+      return false;
+    Emit(c, in);
+  }
+  // The body's repeats stack on the ones open here.
+  if (c->depth + proc->body.depth > c->prog->depth)
+    c->prog->depth = c->depth + proc->body.depth;
+  if (proc->calls > c->calls)
+    c->calls = proc->calls;
+  c->cacheable &= proc->cacheable;
+  return true;
+}
+
+// Compiles commands until close ("]" or "END") or, without one, the end of src.
+bool CompileBlock(Compiler* c, const char* close) {
+  for (;;) {
+    Nob_String_View tok = NextToken(&c->src);
+    if (tok.count == 0) {
+      if (close)
+        return CompileError(c, strcmp(close, "]") == 0 ? "missing ]" : "missing END", tok);
+      return true;
+    }
+    if (nob_sv_eq(tok, nob_sv_from_cstr("]")) || TokenIs(tok, "END")) {
+      if (close && TokenIs(tok, close))
+        return true;
+      return CompileError(c, tok.data[0] == ']' ? "unexpected ]" : "unexpected END", tok);
+    }
+    if (TokenIs(tok, "TO")) {
+      if (close)
+        return CompileError(c, "invalid in block", tok);
+      if (!CompileProcedure(c, tok))
+        return false;
+      continue;
+    }
+
+    TurtleCmd* tc = GetCmd(*c->cmds, tok);
+    if (!tc) {
+      ptrdiff_t proc = FindProcedure(tok);
+      if (proc < 0)
+        return CompileError(c, "invalid cmd", tok);
+      if (!CompileCall(c, (size_t)proc, tok))
+        return false;
+      continue;
+    }
+    if (c->inSwarm && (tc->cmd == CMD_CS || tc->cmd == CMD_SWARM))
+      return CompileError(c, "invalid in swarm", tok);
+
+    Instr in = {0};
+    Nob_String_View arg = {0};
+    if (tc->argRequired) {
+      arg = NextToken(&c->src);
+      if (arg.count == 0)
+        return CompileError(c, "no arg", tok);
+    }
+
+    switch (tc->cmd) {
+      case CMD_FD:
+      case CMD_BK:
+      case CMD_LT:
+      case CMD_RT: {
+        bool negate = tc->cmd == CMD_BK || tc->cmd == CMD_LT;
+        bool isMove = tc->cmd == CMD_FD || tc->cmd == CMD_BK;
+        in.op = isMove ? OP_MOVE : OP_TURN;
+        if (!CompileOperand(c, arg, negate ? -1 : 1, &in))
+          return false;
+        // Zero was always rejected, FD 0 and RT 0 are most likely typos.
+        // Distances keep their fractions though, they used to be cut to whole pixels.
+        if (!(in.flags & INSTR_ARG) && in.as.amt == 0)
+          return CompileError(c, "invalid arg", arg);
+        int32_t milli = 0;
+        if (!isMove && !(in.flags & INSTR_ARG) && ParseMilli(arg, negate, &milli)) {
+          in.flags |= INSTR_EXACT_TURN;
+          in.as.milli = milli;
+        }
+        Emit(c, in);
+      } break;
+      case CMD_SETPC:
+      case CMD_SETBG: {
+        Color color = LookupColor(arg);
+        if (color.a == 0)
+          return CompileError(c, "invalid arg", arg);
+        in.op = tc->cmd == CMD_SETPC ? OP_SETPC : OP_SETBG;
+        in.as.color = color;
+        Emit(c, in);
+      } break;
+      case CMD_H:  in.op = OP_HOME; c->cacheable = false; Emit(c, in); break;
+      case CMD_CS: in.op = OP_CS;   c->cacheable = false; Emit(c, in); break;
+      case CMD_PD: in.op = OP_PD;   Emit(c, in); break;
+      case CMD_PU: in.op = OP_PU;   Emit(c, in); break;
+      case CMD_RP:
+      case CMD_SWARM: {
+        bool swarm = tc->cmd == CMD_SWARM;
+        if (!swarm && arg.data[0] == ':') {
+          // Checked when it runs, counts below 1 skip the body.
+          if (!CompileOperand(c, arg, 1, &in))
+            return false;
+        } else {
+          float count = 0;
+          // Range checked as a float, the cast is undefined from 2^32 up.
+          if (!ParseNumber(arg, &count) || count < 1 || count >= 4294967296.0f || count != floorf(count)
+              || (swarm && count > SWARM_CAP))
+            return CompileError(c, "invalid arg", arg);
+          in.as.count = (uint32_t)count;
+        }
+        Nob_String_View open = NextToken(&c->src);
+        if (!nob_sv_eq(open, nob_sv_from_cstr("[")))
+          return CompileError(c, "missing [", open);
+
+        size_t start = c->prog->count;
+        in.op = swarm ? OP_SWARM : OP_REPEAT;
+        Emit(c, in);
+        // Swarm groups get loop counters of their own, sized like any
+        // other run's, so only repeats deepen the loop stack.
+        if (!swarm)
+          c->depth++;
+        if (c->depth > c->prog->depth)
+          c->prog->depth = c->depth;
+        if (swarm) {
+          c->inSwarm = true;
+          c->cacheable = false;
+        }
+        if (!CompileBlock(c, "]"))
+          return false;
+        if (swarm)
+          c->inSwarm = false;
+        else
+          c->depth--;
+        Instr end = { .op = OP_END, .jump = start };
+        Emit(c, end);
+        c->prog->items[start].jump = c->prog->count - 1;
+        if (!swarm && !(in.flags & INSTR_ARG) && IsClosedFormBody(c->prog, start + 1, c->prog->count - 1))
+          c->prog->items[start].flags |= INSTR_CLOSED_FORM;
+      } break;
+      case CMD_COUNT: NOB_UNREACHABLE("CMD_COUNT");
+    }
+  }
+}
+
+#define NO_INDEX SIZE_MAX
+
+// State of the peephole pass over the instructions emitted so far. Pen and
+// color are only known from PU/PD/SETPC earlier in the same block, a block
+// (the program or a repeat body) starts out knowing nothing.
+typedef struct {
+  Program* prog;
+  size_t count;         // instructions emitted
+  size_t block;         // first instruction of the current block
+  int pen;              // -1 unknown, 0 up, 1 down
+  bool colorKnown;
+  Color color;
+  size_t pendingPen;    // PU/PD no move has used yet, the pen state before it in penBefore
+  int penBefore;
+  size_t pendingColor;  // same for SETPC
+  bool colorKnownBefore;
+  Color colorBefore;
+  size_t travel;        // first instruction of the current pen-up chain of moves and turns
+} Peephole;
+
+void PeepholeBlock(Peephole* ph) {
+  ph->block = ph->count;
+  ph->pen = -1;
+  ph->colorKnown = false;
+  ph->pendingPen = ph->pendingColor = ph->travel = NO_INDEX;
+}
+
+Instr* PeepholeLast(Peephole* ph, OpCode op) {
+  if (ph->count == ph->block || ph->prog->items[ph->count - 1].op != op || (ph->prog->items[ph->count - 1].flags & INSTR_ARG))
+    return NULL;
+  return &ph->prog->items[ph->count - 1];
+}
+
+
+void PeepholeEmit(Peephole* ph, Instr in) {
+  ph->prog->items[ph->count++] = in;
+}
+
+void PeepholeRemove(Peephole* ph, size_t i) {
+  Instr* items = ph->prog->items;
+  memmove(&items[i], &items[i + 1], (ph->count - i - 1) * sizeof(*items));
+  ph->count--;
+  if (ph->pendingPen != NO_INDEX && ph->pendingPen > i) ph->pendingPen--;
+  if (ph->pendingColor != NO_INDEX && ph->pendingColor > i) ph->pendingColor--;
+  if (ph->travel != NO_INDEX && ph->travel > i) ph->travel--;
+  if (ph->travel != NO_INDEX && ph->travel >= ph->count) ph->travel = NO_INDEX;
+}
+
+Angle TurnAngle(const Instr* in) {
+  return (in->flags & INSTR_EXACT_TURN) ? AngleFromMilli(in->as.milli) : AngleFromDegrees(in->as.amt);
+}
+
+Instr TurnInstr(Angle a) {
+  if (a.exact)
+    return (Instr) { .op = OP_TURN, .flags = INSTR_EXACT_TURN, .as.milli = a.milli };
+  return (Instr) { .op = OP_TURN, .as.amt = a.degrees };
+}
+
+bool IsZeroAngle(Angle a) {
+  return a.exact ? a.milli == 0 : a.degrees == 0;
+}
+
+// Replaces a pen-up chain holding more than one move by a single OP_TRAVEL
+// followed by the chain's total turn.
+void CollapseTravel(Peephole* ph) {
+  Instr* items = ph->prog->items;
+  size_t moves = 0;
+  for (size_t i = ph->travel; i < ph->count; ++i)
+    moves += items[i].op != OP_TURN;
+  if (moves < 2)
+    return;
+
+  Vector2 d = {0};
+  Angle angle = AngleFromMilli(0);
+  for (size_t i = ph->travel; i < ph->count; ++i) {
+    Vector2 h = HeadingVector(angle);
+    if (items[i].op == OP_MOVE) {
+      d.x += items[i].as.amt * h.x;
+      d.y += items[i].as.amt * h.y;
+    } else if (items[i].op == OP_TRAVEL) {
+      d.x += h.x*items[i].as.d.x - h.y*items[i].as.d.y;
+      d.y += h.y*items[i].as.d.x + h.x*items[i].as.d.y;
+    } else {
+      angle = AddAngles(angle, TurnAngle(&items[i]));
+    }
+  }
+  ph->count = ph->travel;
+  if (d.x != 0 || d.y != 0)
+    PeepholeEmit(ph, (Instr) { .op = OP_TRAVEL, .as.d = d });
+  if (!IsZeroAngle(angle))
+    PeepholeEmit(ph, TurnInstr(angle));
+  if (ph->travel >= ph->count)
+    ph->travel = NO_INDEX;
+}
+
+void PeepholeMove(Peephole* ph, Instr in) {
+  // Moving uses the pen, so earlier PU/PD/SETPC are no longer dead.
+  ph->pendingPen = ph->pendingColor = NO_INDEX;
+  Instr* last = PeepholeLast(ph, OP_MOVE);
+  // Same direction moves draw one straight line either way, with the pen up
+  // any two moves add up.
+  if (last && (ph->pen == 0 || (last->as.amt > 0 && in.as.amt > 0) || (last->as.amt < 0 && in.as.amt < 0))) {
+    last->as.amt += in.as.amt;
+    if (last->as.amt == 0 && ph->pen == 0)
+      PeepholeRemove(ph, ph->count - 1);
+  } else if (!(in.as.amt == 0 && ph->pen == 0)) {
+    PeepholeEmit(ph, in);
+    if (ph->pen == 0 && ph->travel == NO_INDEX)
+      ph->travel = ph->count - 1;
+  }
+  if (ph->travel != NO_INDEX)
+    CollapseTravel(ph);
+}
+
+void PeepholeTurn(Peephole* ph, Instr in) {
+  Instr* last = PeepholeLast(ph, OP_TURN);
+  if (last) {
+    Angle sum = AddAngles(TurnAngle(last), TurnAngle(&in));
+    if (IsZeroAngle(sum))
+      PeepholeRemove(ph, ph->count - 1);
+    else
+      *last = TurnInstr(sum);
+  } else if (!IsZeroAngle(TurnAngle(&in))) {
+    PeepholeEmit(ph, in);
+    if (ph->pen == 0 && ph->travel == NO_INDEX)
+      ph->travel = ph->count - 1;
+  }
+  if (ph->travel != NO_INDEX)
+    CollapseTravel(ph);
+}
+
+// PU/PD followed by another PU/PD before any move is dead.
+void PeepholePen(Peephole* ph, Instr in) {
+  ph->travel = NO_INDEX;
+  if (ph->pendingPen != NO_INDEX) {
+    ph->pen = ph->penBefore;
+    PeepholeRemove(ph, ph->pendingPen);
+    ph->pendingPen = NO_INDEX;
+  }
+  int pen = in.op == OP_PD;
+  if (ph->pen == pen)
+    return;
+  ph->pendingPen = ph->count;
+  ph->penBefore = ph->pen;
+  ph->pen = pen;
+  PeepholeEmit(ph, in);
+}
+
+// Same for SETPC, and setting the color the pen already has.
+void PeepholeColor(Peephole* ph, Instr in) {
+  ph->travel = NO_INDEX;
+  if (ph->pendingColor != NO_INDEX) {
+    ph->colorKnown = ph->colorKnownBefore;
+    ph->color = ph->colorBefore;
+    PeepholeRemove(ph, ph->pendingColor);
+    ph->pendingColor = NO_INDEX;
+  }
+  if (ph->colorKnown && ColorEq(ph->color, in.as.color))
+    return;
+  ph->pendingColor = ph->count;
+  ph->colorKnownBefore = ph->colorKnown;
+  ph->colorBefore = ph->color;
+  ph->colorKnown = true;
+  ph->color = in.as.color;
+  PeepholeEmit(ph, in);
+}
+
+// Moves and turns by an argument stay as they are and end any pen-up chain.
+void PeepholeArg(Peephole* ph, Instr in) {
+  if (in.op == OP_MOVE)
+    ph->pendingPen = ph->pendingColor = NO_INDEX;
+  ph->travel = NO_INDEX;
+  PeepholeEmit(ph, in);
+}
+
+// Rewrites prog in place without the work machine-generated scripts tend to
+// be full of: adjacent moves are merged, adjacent turns folded, dead or
+// redundant PU/PD/SETPC dropped and pen-up chains of moves and turns
+// collapsed into one OP_TRAVEL. Returns how many instructions it removed.
+size_t OptimizeProgram(Program* prog) {
+  Peephole ph = { .prog = prog };
+  PeepholeBlock(&ph);
+  for (size_t pc = 0; pc < prog->count; ++pc) {
+    Instr in = prog->items[pc];
+    if ((in.op == OP_MOVE || in.op == OP_TURN) && (in.flags & INSTR_ARG)) {
+      PeepholeArg(&ph, in);
+      continue;
+    }
+    switch (in.op) {
+      case OP_MOVE:  PeepholeMove(&ph, in); break;
+      case OP_TURN:  PeepholeTurn(&ph, in); break;
+      case OP_PD:
+      case OP_PU:    PeepholePen(&ph, in); break;
+      case OP_SETPC: PeepholeColor(&ph, in); break;
+      case OP_REPEAT:
+      case OP_SWARM: {
+        // The matching OP_END hasn't been read yet, leave it where this
+        // block ends up.
+        prog->items[in.jump].jump = ph.count;
+        PeepholeEmit(&ph, in);
+        PeepholeBlock(&ph);
+      } break;
+      case OP_END: {
+        prog->items[in.jump].jump = ph.count;
+        PeepholeEmit(&ph, in);
+        PeepholeBlock(&ph);
+      } break;
+      case OP_HOME:
+      case OP_CS:
+      case OP_SETBG:
+        ph.travel = NO_INDEX;
+        PeepholeEmit(&ph, in);
+        break;
+      case OP_CALL:
+      case OP_ARG:
+        // The callee may use and change the pen, nothing is known after it.
+        PeepholeEmit(&ph, in);
+        PeepholeBlock(&ph);
+        break;
+      case OP_TRAVEL:
+      case OP_COUNT: NOB_UNREACHABLE("OptimizeProgram");
+    }
+  }
+  size_t removed = prog->count - ph.count;
+  prog->count = ph.count;
+  return removed;
+}
+
+// Runs shorter than this are cheaper to step through one by one.
+#define MOVE_RUN_MIN 8
+
+// Flags every run of at least MOVE_RUN_MIN moves and turns. Repeats and
+// their ends split runs, so no jump ever lands inside one.
+void MarkMoveRuns(Program* prog) {
+  size_t pc = 0;
+  while (pc < prog->count) {
+    size_t end = pc;
+    while (end < prog->count && (prog->items[end].op == OP_MOVE || prog->items[end].op == OP_TURN) && !(prog->items[end].flags & INSTR_ARG))
+      end++;
+    if (end - pc >= MOVE_RUN_MIN) {
+      prog->items[pc].flags |= INSTR_MOVE_RUN;
+      prog->items[pc].jump = end;
+    }
+    pc = end > pc ? end : pc + 1;
+  }
+}
+
+// Instructions executed by running [begin, end) once, repeats included.
+uint64_t CountSteps(const Program* prog, size_t begin, size_t end) {
+  uint64_t steps = 0;
+  for (size_t pc = begin; pc < end; ++pc) {
+    const Instr* in = &prog->items[pc];
+    uint64_t n = 1;
+    if (in->op == OP_REPEAT) {
+      // Every iteration runs the body and the OP_END.
+      uint64_t body = CountSteps(prog, pc + 1, in->jump) + 1;
+      uint64_t count = (in->flags & INSTR_ARG) ? 1 : in->as.count;
+      if (__builtin_mul_overflow(body, count, &n) || __builtin_add_overflow(n, 1, &n))
+        n = UINT64_MAX;
+      pc = in->jump;
+    } else if (in->op == OP_CALL) {
+      // The OP_ARGs are read by the call, not run.
+      const Procedure* proc = &Procs.items[in->as.count];
+      if (__builtin_add_overflow(proc->body.steps, 1, &n))
+        n = UINT64_MAX;
+      pc += proc->arity;
+    } else if (in->op == OP_SWARM) {
+      // Every member runs the body once, plus the OP_SWARM and OP_END.
+      uint64_t body = CountSteps(prog, pc + 1, in->jump);
+      if (__builtin_mul_overflow(body, (uint64_t)in->as.count, &n) || __builtin_add_overflow(n, 2, &n))
+        n = UINT64_MAX;
+      pc = in->jump;
+    }
+    if (__builtin_add_overflow(steps, n, &steps))
+      steps = UINT64_MAX;
+  }
+  return steps;
+}
+
+// Optimizes a freshly compiled program and works out what running it needs.
+void PrepareProgram(Program* prog) {
+  size_t count = prog->count;
+  size_t removed = OptimizeProgram(prog);
+  if (removed > 0)
+    nob_log(NOB_INFO, "optimizer removed %zu of %zu instructions", removed, count);
+  MarkMoveRuns(prog);
+  prog->steps = CountSteps(prog, 0, prog->count);
+}
+
+// Compiles src (any number of commands, repeats may nest) into prog.
+// Procedures it defines stay defined for later programs, unless it fails.
+// On failure error points at a short message for the history.
+bool CompileProgram(Nob_String_View src, TurtleCmds* commands, Program* prog, const char** error) {
+  ReclaimProcedures();
+  prog->count = 0;
+  prog->depth = 0;
+  Compiler c = { .src = src, .cmds = commands, .prog = prog, .error = "" };
+  bool ok = CompileBlock(&c, NULL);
+  if (ok) {
+    CommitProcedures();
+  } else {
+    nob_log(NOB_ERROR, "%s: "SV_Fmt, c.error, SV_Arg(c.errorToken));
+    prog->count = 0;
+    DropProcedures();
+  }
+  PrepareProgram(prog);
+  *error = c.error;
+  return ok;
+}
+
+// Compiles a command line typed into the prompt. Errors go into the history
+// right away, a line that compiles only once its program is posted.
+bool CompileCommandText(Nob_String_View cmdText, TurtleCmds* commands, Program* prog, CmdHistory* history) {
+  const char* error = "";
+  bool ok = CompileProgram(cmdText, commands, prog, &error);
+  if (!ok)
+    PushCmdHistory(history, cmdText, error);
+  return ok;
+}
+
+double NowSeconds(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+size_t CpuCount(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t)n : 1;
+}
+
+// Task indices a participant of a job still has to run, packed into one
+// word (begin in the low half, end in the high half) so the owner taking
+// from the front and thieves taking from the back agree with a single
+// compare and swap. Each sits on its own cache line.
+typedef struct {
+  _Alignas(64) atomic_uint_least64_t range;
+} TaskDeque;
+
+#define POOL_MAX_THREADS 64
+
+// Worker threads started once and reused by every ParallelFor. A job's tasks
+// are split evenly across the participants up front; one that runs out
+// steals the back half of another's range, so uneven tasks still balance.
+typedef struct {
+  pthread_mutex_t submit;  // one job at a time
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  pthread_t threads[POOL_MAX_THREADS];
+  size_t workers;          // started threads, the caller of ParallelFor is one more participant
+  bool started;
+  bool quit;
+  uint64_t job;            // bumped for every job, so workers see new ones
+  size_t participants;
+  size_t finished;         // participating workers done with the job
+  void (*fn)(void* ctx, size_t i);
+  void* ctx;
+  TaskDeque deques[POOL_MAX_THREADS];
+} TaskPool;
+
+static TaskPool Pool = {
+  .submit = PTHREAD_MUTEX_INITIALIZER,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+// Participant index of the calling thread in the running job, -1 outside one.
+static _Thread_local int PoolSlot = -1;
+
+uint64_t PackRange(uint32_t begin, uint32_t end) {
+  return (uint64_t)end << 32 | begin;
+}
+
+bool PopTask(TaskDeque* d, size_t* i) {
+  uint64_t r = atomic_load(&d->range);
+  for (;;) {
+    uint32_t begin = (uint32_t)r, end = (uint32_t)(r >> 32);
+    if (begin >= end)
+      return false;
+    if (atomic_compare_exchange_weak(&d->range, &r, PackRange(begin + 1, end))) {
+      *i = begin;
+      return true;
+    }
+  }
+}
+
+// Moves the back half of victim's range into d, which must be empty.
+bool StealTasks(TaskDeque* victim, TaskDeque* d) {
+  uint64_t r = atomic_load(&victim->range);
+  for (;;) {
+    uint32_t begin = (uint32_t)r, end = (uint32_t)(r >> 32);
+    if (begin >= end)
+      return false;
+    uint32_t mid = begin + (end - begin) / 2;
+    if (atomic_compare_exchange_weak(&victim->range, &r, PackRange(begin, mid))) {
+      atomic_store(&d->range, PackRange(mid, end));
+      return true;
+    }
+  }
+}
+
+// Returns once no participant has tasks left to take. Tasks a thief is
+// still holding are run by that thief before it finishes.
+void RunPoolTasks(TaskPool* pool, size_t slot) {
+  PoolSlot = (int)slot;
+  for (;;) {
+    size_t i;
+    if (PopTask(&pool->deques[slot], &i)) {
+      pool->fn(pool->ctx, i);
+      continue;
+    }
+    bool stole = false;
+    for (size_t k = 1; k < pool->participants && !stole; ++k)
+      stole = StealTasks(&pool->deques[(slot + k) % pool->participants], &pool->deques[slot]);
+    if (!stole)
+      break;
+  }
+  PoolSlot = -1;
+}
+
+void* PoolWorker(void* arg) {
+  size_t slot = (size_t)arg;
+  uint64_t seen = 0;
+  pthread_mutex_lock(&Pool.lock);
+  for (;;) {
+    while (!Pool.quit && Pool.job == seen)
+      pthread_cond_wait(&Pool.wake, &Pool.lock);
+    if (Pool.quit)
+      break;
+    seen = Pool.job;
+    if (slot >= Pool.participants)
+      continue;
+    pthread_mutex_unlock(&Pool.lock);
+    RunPoolTasks(&Pool, slot);
+    pthread_mutex_lock(&Pool.lock);
+    Pool.finished++;
+    pthread_cond_signal(&Pool.done);
+  }
+  pthread_mutex_unlock(&Pool.lock);
+  return NULL;
+}
+
+// Workers take participant slots 1 and up, the thread calling ParallelFor is slot 0.
+void StartPool(size_t threads) {
+  if (threads > POOL_MAX_THREADS)
+    threads = POOL_MAX_THREADS;
+  Pool.started = true;
+  for (size_t i = 1; i < threads; ++i) {
+    if (pthread_create(&Pool.threads[Pool.workers], NULL, PoolWorker, (void*)i) != 0)
+      break;
+    Pool.workers++;
+  }
+}
+
+void StopPool(void) {
+  pthread_mutex_lock(&Pool.lock);
+  Pool.quit = true;
+  pthread_cond_broadcast(&Pool.wake);
+  pthread_mutex_unlock(&Pool.lock);
+  for (size_t i = 0; i < Pool.workers; ++i)
+    pthread_join(Pool.threads[i], NULL);
+  Pool.workers = 0;
+  Pool.started = false;
+  Pool.quit = false;
+}
+
+// Calls fn(ctx, i) for every i in [0, count) on up to threads threads of the
+// pool, which is started by the first call with threads threads. The calling
+// thread works too, jobs with one task or thread and calls made from inside a
+// task run everything inline. Tasks can use ParallelSlot() to pick per-thread
+// scratch space.
+void ParallelFor(size_t threads, size_t count, void (*fn)(void* ctx, size_t i), void* ctx) {
+  NOB_ASSERT(count <= UINT32_MAX);
+  // The pool lives for the whole process, so it is sized by what was asked
+  // for and only each job is cut down to its task count.
+  size_t participants = threads < count ? threads : count;
+  if (participants <= 1 || PoolSlot >= 0) {
+    // Scratch space belongs to the job, so an inline job always uses slot 0.
+    int slot = PoolSlot;
+    PoolSlot = 0;
+    for (size_t i = 0; i < count; ++i)
+      fn(ctx, i);
+    PoolSlot = slot;
+    return;
+  }
+
+  pthread_mutex_lock(&Pool.submit);
+  if (!Pool.started)
+    StartPool(threads);
+  if (participants > Pool.workers + 1)
+    participants = Pool.workers + 1;
+  for (size_t p = 0; p < participants; ++p)
+    atomic_store(&Pool.deques[p].range, PackRange(count * p / participants, count * (p + 1) / participants));
+  pthread_mutex_lock(&Pool.lock);
+  Pool.fn = fn;
+  Pool.ctx = ctx;
+  Pool.participants = participants;
+  Pool.finished = 0;
+  Pool.job++;
+  pthread_cond_broadcast(&Pool.wake);
+  pthread_mutex_unlock(&Pool.lock);
+
+  RunPoolTasks(&Pool, 0);
+
+  pthread_mutex_lock(&Pool.lock);
+  while (Pool.finished + 1 < participants)
+    pthread_cond_wait(&Pool.done, &Pool.lock);
+  pthread_mutex_unlock(&Pool.lock);
+  pthread_mutex_unlock(&Pool.submit);
+}
+
+// Participant slot of the calling task, below the threads passed to ParallelFor.
+size_t ParallelSlot(void) {
+  return PoolSlot >= 0 ? (size_t)PoolSlot : 0;
+}
+
+// Line stores the tasks of swarms and closed form repeats draw into, kept from
+// one job to the next so repeating one doesn't go back to the heap. Those jobs
+// never nest, so one set serves both.
+static struct {
+  LineStore* items;
+  size_t count;
+  size_t capacity;
+} TaskStores = {0};
+
+// The first count task stores, empty.
+LineStore* GetTaskStores(size_t count) {
+  while (TaskStores.count < count)
+    GROWTH(nob_da_append(&TaskStores, ((LineStore) {0})));
+  return TaskStores.items;
+}
+
+void FreeTaskStores(void) {
+  for (size_t i = 0; i < TaskStores.count; ++i)
+    FreeLineStore(&TaskStores.items[i]);
+  nob_da_free(TaskStores);
+  TaskStores.items = NULL;
+  TaskStores.count = TaskStores.capacity = 0;
+}
+
+// Loop stack depth that lives on the C stack. Deeper programs get one heap
+// allocation per run, never one per iteration.
+#define LOOP_STACK_CAP 64
+
+// Execution settings shared by every program run.
+typedef struct {
+  bool closedForm;  // run eligible repeats with RunRepeatClosedForm
+  size_t threads;
+} ExecOptions;
+
+static ExecOptions Exec = { .closedForm = false, .threads = 1 };
+
+// Repeats shorter than this aren't worth splitting up.
+#define CLOSED_FORM_MIN_ITERATIONS 256
+
+// Chunks a closed form repeat is cut into. Chunk starts are where rounding
+// differs from stepping, so the count is fixed to keep the output the same
+// for any thread count; the pool balances chunks across the threads.
+#define CLOSED_FORM_CHUNKS 64
+
+// Rigid transform of the turtle's pose: rotate by angle, then move by d
+// expressed in the turtle's frame before the rotation.
+typedef struct {
+  Angle angle;
+  Vector2 d;
+} PoseTransform;
+
+PoseTransform ComposeTransforms(PoseTransform a, PoseTransform b) {
+  Vector2 h = HeadingVector(a.angle);
+  float c = h.x, s = h.y;
+  PoseTransform r = {
+    .angle = AddAngles(a.angle, b.angle),
+    .d = { a.d.x + c*b.d.x - s*b.d.y, a.d.y + s*b.d.x + c*b.d.y },
+  };
+  return r;
+}
+
+void ApplyTransform(Turtle* t, PoseTransform tr) {
+  float c = t->heading.x, s = t->heading.y;
+  t->position.x += c*tr.d.x - s*tr.d.y;
+  t->position.y += s*tr.d.x + c*tr.d.y;
+  TurnTurtle(t, tr.angle);
+}
+
+// Where to continue once a procedure returns, saved by its OP_CALL.
+typedef struct {
+  const Program* prog;
+  size_t pc;          // the call's last OP_ARG
+  size_t end;
+  const float* args;  // the caller's arguments
+  float values[PROC_ARGS_CAP];  // the callee's
+} CallFrame;
+
+// Execution state of a program, everything needed to stop after any
+// instruction and pick up there later.
+typedef struct {
+  const Program* prog;  // the running procedure's body while in a call
+  size_t pc;
+  size_t end;
+  uint32_t* loops;  // iterations left of each open repeat, prog->depth of them
+  size_t sp;
+  bool closedForm;
+  uint64_t steps;   // instructions executed, see Program.steps
+  const float* args;   // arguments of the running procedure
+  CallFrame* frames;   // CALL_DEPTH_CAP of them, programs without calls can leave it NULL
+  size_t fp;
+} Vm;
+
+bool StepVm(Vm* vm, Turtle* t, uint64_t maxSteps);
+
+void RunRange(Turtle* t, const Program* prog, size_t begin, size_t end, uint32_t* loops, bool closedForm) {
+  Vm vm = { .prog = prog, .pc = begin, .end = end, .loops = loops, .closedForm = closedForm };
+  StepVm(&vm, t, UINT64_MAX);
+}
+
+typedef struct {
+  const Program* prog;
+  size_t body;         // first body instruction
+  size_t end;          // the matching OP_END
+  size_t iterations;   // per chunk, the last chunk may run fewer
+  size_t total;        // iterations split across the chunks
+  Turtle* starts;      // turtle state at the start of each chunk
+  uint32_t* loops;     // prog->depth loop counters per chunk when the stack ones are too few
+} ClosedFormJob;
+
+void RunClosedFormChunk(void* ctx, size_t chunk) {
+  ClosedFormJob* job = ctx;
+  Turtle* t = &job->starts[chunk];
+  size_t first = chunk * job->iterations;
+  size_t n = first + job->iterations > job->total ? job->total - first : job->iterations;
+  uint32_t stackLoops[LOOP_STACK_CAP];
+  uint32_t* loops = job->loops ? job->loops + chunk * job->prog->depth : stackLoops;
+  for (size_t i = 0; i < n; ++i)
+    RunRange(t, job->prog, job->body, job->end, loops, false);
+}
+
+// Runs a repeat whose body applies the same transform every iteration
+// without walking the iterations one after another. The first iteration runs
+// normally and yields the body's transform T and the pen state every later
+// iteration starts with. The remaining iterations are cut into chunks, the
+// starting pose of chunk j is the prefix composition of T^m (m iterations per
+// chunk, computed by squaring), and the chunks then run independently, in
+// parallel, into their own line stores that are appended in order.
+void RunRepeatClosedForm(Turtle* t, const Program* prog, size_t pc, uint32_t* loops) {
+  const Instr* in = &prog->items[pc];
+  Vector2 p0 = t->position;
+  Angle r0 = t->rotation;
+  RunRange(t, prog, pc + 1, in->jump, loops, false);
+
+  Vector2 back = HeadingVector(NegateAngle(r0));
+  float c = back.x, s = back.y;
+  Vector2 dp = { t->position.x - p0.x, t->position.y - p0.y };
+  PoseTransform body = {
+    .angle = AddAngles(t->rotation, NegateAngle(r0)),
+    .d = { c*dp.x - s*dp.y, s*dp.x + c*dp.y },
+  };
+
+  size_t total = in->as.count - 1;
+  size_t chunks = CLOSED_FORM_CHUNKS;
+  if (chunks > total)
+    chunks = total;
+  size_t iterations = (total + chunks - 1) / chunks;
+  chunks = (total + iterations - 1) / iterations;
+
+  PoseTransform step = { .angle = AngleFromMilli(0) };
+  PoseTransform power = body;
+  for (size_t m = iterations; m > 0; m >>= 1) {
+    if (m & 1)
+      step = ComposeTransforms(step, power);
+    power = ComposeTransforms(power, power);
+  }
+
+  ClosedFormJob job = {
+    .prog = prog, .body = pc + 1, .end = in->jump,
+    .iterations = iterations, .total = total,
+    .starts = ArenaAlloc(&CommandArena, chunks * sizeof(Turtle)),
+  };
+  // The workers can't share the arena, hand them their loop stacks.
+  if (prog->depth > LOOP_STACK_CAP)
+    job.loops = ArenaAlloc(&CommandArena, chunks * prog->depth * sizeof(*job.loops));
+  LineStore* stores = GetTaskStores(chunks);
+  Turtle start = *t;
+  for (size_t j = 0; j < chunks; ++j) {
+    job.starts[j] = start;
+    job.starts[j].lines = stores[j];
+    job.starts[j].lines.noMerge = false;
+    ApplyTransform(&start, step);
+  }
+  ParallelFor(Exec.threads, chunks, RunClosedFormChunk, &job);
+
+  for (size_t j = 0; j < chunks; ++j) {
+    LineStore* lines = &job.starts[j].lines;
+    for (LineRef ref = {0}; NextLine(lines, &ref);) {
+      TLine line = GetLine(lines, ref);
+      // Chunk starts come from the composed transform and can be off by a
+      // rounding error from where the previous chunk ended, keep the strip connected.
+      if (ref.vertex - 1 == lines->polylines.items[ref.poly].first && t->lines.count > 0) {
+        Vector2 last = { t->lines.xs[t->lines.count-1], t->lines.ys[t->lines.count-1] };
+        if (fabsf(last.x - line.start.x) <= LINE_MERGE_EPSILON && fabsf(last.y - line.start.y) <= LINE_MERGE_EPSILON)
+          line.start = last;
+      }
+      AppendLine(&t->lines, line.start, line.end, line.thickness, line.color);
+    }
+    ClearLineStore(lines);
+    stores[j] = *lines;
+  }
+  Turtle* last = &job.starts[chunks - 1];
+  t->position = last->position;
+  t->rotation = last->rotation;
+  t->heading = last->heading;
+  t->pen = last->pen;
+  t->background = last->background;
+}
+
+// Moves handled per pass of RunMoveRun, sized so the scratch arrays stay on
+// the stack and in L1.
+#define MOVE_RUN_CHUNK 256
+
+// d[i] = amt[i] * h[i] for both axes, the same single rounding GetEnd does.
+void ScaleHeadings(float* dx, float* dy, const float* amt, const float* hx, const float* hy, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 4 <= n; i += 4) {
+    __m128 a = _mm_loadu_ps(amt + i);
+    _mm_storeu_ps(dx + i, _mm_mul_ps(a, _mm_loadu_ps(hx + i)));
+    _mm_storeu_ps(dy + i, _mm_mul_ps(a, _mm_loadu_ps(hy + i)));
+  }
+#endif
+  for (; i < n; ++i) {
+    dx[i] = amt[i] * hx[i];
+    dy[i] = amt[i] * hy[i];
+  }
+}
+
+// Executes the run of moves and turns flagged at prog->items[begin] up to end
+// in three passes per chunk: headings by a running sum of the turns (integer
+// millidegrees and table lookups while the angle stays exact), the move
+// vectors in one vectorized multiply, then the positions by a running sum.
+// The sums add in program order, so the result is bit for bit what stepping
+// through the instructions gives, only the per-instruction dispatch is gone.
+void RunMoveRun(Turtle* t, const Program* prog, size_t begin, size_t end) {
+  float amt[MOVE_RUN_CHUNK], hx[MOVE_RUN_CHUNK], hy[MOVE_RUN_CHUNK];
+  float dx[MOVE_RUN_CHUNK], dy[MOVE_RUN_CHUNK];
+  float px[MOVE_RUN_CHUNK + 1], py[MOVE_RUN_CHUNK + 1];
+  Angle rotation = t->rotation;
+  Vector2 heading = t->heading;
+  size_t pc = begin;
+  while (pc < end) {
+    size_t n = 0;
+    for (; pc < end && n < MOVE_RUN_CHUNK; ++pc) {
+      const Instr* in = &prog->items[pc];
+      if (in->op == OP_MOVE) {
+        amt[n] = in->as.amt;
+        hx[n] = heading.x;
+        hy[n] = heading.y;
+        n++;
+      } else if (rotation.exact && (in->flags & INSTR_EXACT_TURN)) {
+        int32_t m = rotation.milli + in->as.milli;
+        rotation.milli = m >= MILLI_TURN ? m - MILLI_TURN : m;
+        rotation.degrees = rotation.milli / 1000.0f;
+        heading = (Vector2) { SinMilli((rotation.milli + MILLI_QUARTER) % MILLI_TURN), SinMilli(rotation.milli) };
+      } else {
+        Angle delta = (in->flags & INSTR_EXACT_TURN) ? AngleFromMilli(in->as.milli) : AngleFromDegrees(in->as.amt);
+        rotation = AddAngles(rotation, delta);
+        heading = HeadingVector(rotation);
+      }
+    }
+
+    ScaleHeadings(dx, dy, amt, hx, hy, n);
+    px[0] = t->position.x;
+    py[0] = t->position.y;
+    for (size_t i = 0; i < n; ++i) {
+      px[i+1] = px[i] + dx[i];
+      py[i+1] = py[i] + dy[i];
+    }
+
+    if (t->pen.down) {
+      ReserveVertices(&t->lines, n);
+      for (size_t i = 0; i < n; ++i)
+        AppendLine(&t->lines, (Vector2) { px[i], py[i] }, (Vector2) { px[i+1], py[i+1] }, t->pen.width, t->pen.color);
+    }
+    t->position = (Vector2) { px[n], py[n] };
+  }
+  t->rotation = rotation;
+  t->heading = heading;
+}
+
+// Members of a SWARM, one array per field so a move or turn updates all of
+// them in a single pass over contiguous memory. They run the same
+// instructions from the same pen state, so only their poses differ and the
+// pen, color and background stay on the Turtle running them.
+typedef struct {
+  size_t count;
+  float* xs;
+  float* ys;
+  float* hx;         // heading, see Turtle.heading
+  float* hy;
+  int32_t* milli;    // rotation, see Angle
+  float* degrees;
+  bool exact;        // every member's rotation is exact
+  float* trailX;     // positions after each pen down move, trail rows of count
+  float* trailY;
+  size_t trail;
+} Swarm;
+
+// Rows of positions gathered before a swarm's lines are appended. Each member
+// gets one polyline per flush, so longer trails mean fewer, longer strips.
+#define SWARM_TRAIL_ROWS 64
+
+// Members stepped together as one task, small enough that a group's arrays
+// stay in L1 and fixed so the line order doesn't depend on the thread count.
+#define SWARM_GROUP 256
+
+// Member i starts at the turtle's position, turned by i/count of a full turn.
+// Offsets are rounded to millidegrees so an exact turtle spawns exact members.
+Swarm CreateSwarm(const Turtle* t, size_t count) {
+  Swarm s = {
+    .count = count,
+    .xs = ArenaAlloc(&CommandArena, count * sizeof(float)),
+    .ys = ArenaAlloc(&CommandArena, count * sizeof(float)),
+    .hx = ArenaAlloc(&CommandArena, count * sizeof(float)),
+    .hy = ArenaAlloc(&CommandArena, count * sizeof(float)),
+    .milli = ArenaAlloc(&CommandArena, count * sizeof(int32_t)),
+    .degrees = ArenaAlloc(&CommandArena, count * sizeof(float)),
+    .exact = t->rotation.exact,
+    .trailX = ArenaAlloc(&CommandArena, SWARM_TRAIL_ROWS * count * sizeof(float)),
+    .trailY = ArenaAlloc(&CommandArena, SWARM_TRAIL_ROWS * count * sizeof(float)),
+  };
+  for (size_t i = 0; i < count; ++i) {
+    Angle offset = AngleFromMilli((int64_t)(i * MILLI_TURN / count));
+    Angle a = AddAngles(t->rotation, offset);
+    Vector2 h = HeadingVector(a);
+    s.xs[i] = t->position.x;
+    s.ys[i] = t->position.y;
+    s.hx[i] = h.x;
+    s.hy[i] = h.y;
+    s.milli[i] = a.milli;
+    s.degrees[i] = a.degrees;
+  }
+  return s;
+}
+
+// Same arithmetic as GetEnd for every member.
+void MoveSwarm(Swarm* s, float amt) {
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128 a = _mm_set1_ps(amt);
+  for (; i + 4 <= s->count; i += 4) {
+    _mm_storeu_ps(s->xs + i, _mm_add_ps(_mm_loadu_ps(s->xs + i), _mm_mul_ps(a, _mm_loadu_ps(s->hx + i))));
+    _mm_storeu_ps(s->ys + i, _mm_add_ps(_mm_loadu_ps(s->ys + i), _mm_mul_ps(a, _mm_loadu_ps(s->hy + i))));
+  }
+#endif
+  for (; i < s->count; ++i) {
+    s->xs[i] = s->xs[i] + amt * s->hx[i];
+    s->ys[i] = s->ys[i] + amt * s->hy[i];
+  }
+}
+
+// Same as TurnTurtle for every member. While all rotations stay exact this is
+// an integer add and two table lookups per member.
+void TurnSwarm(Swarm* s, Angle delta) {
+  if (s->exact && delta.exact) {
+    for (size_t i = 0; i < s->count; ++i) {
+      int32_t m = s->milli[i] + delta.milli;
+      s->milli[i] = m >= MILLI_TURN ? m - MILLI_TURN : m;
+      s->degrees[i] = s->milli[i] / 1000.0f;
+    }
+    for (size_t i = 0; i < s->count; ++i) {
+      s->hx[i] = SinMilli((s->milli[i] + MILLI_QUARTER) % MILLI_TURN);
+      s->hy[i] = SinMilli(s->milli[i]);
+    }
+    return;
+  }
+  for (size_t i = 0; i < s->count; ++i) {
+    Angle a = { .milli = s->milli[i], .degrees = s->degrees[i], .exact = s->exact };
+    a = AddAngles(a, delta);
+    Vector2 h = HeadingVector(a);
+    s->milli[i] = a.milli;
+    s->degrees[i] = a.degrees;
+    s->hx[i] = h.x;
+    s->hy[i] = h.y;
+  }
+  s->exact = s->exact && delta.exact;
+}
+
+void RecordSwarmTrail(Swarm* s) {
+  memcpy(s->trailX + s->trail * s->count, s->xs, s->count * sizeof(float));
+  memcpy(s->trailY + s->trail * s->count, s->ys, s->count * sizeof(float));
+  s->trail++;
+}
+
+// Appends the gathered trail member by member, so the store's order only
+// depends on the program and not on how the members were stepped.
+void FlushSwarmTrail(Swarm* s, Turtle* t) {
+  if (s->trail >= 2) {
+    ReserveVertices(&t->lines, s->count * s->trail);
+    for (size_t i = 0; i < s->count; ++i) {
+      for (size_t r = 1; r < s->trail; ++r) {
+        size_t from = (r - 1) * s->count + i, to = r * s->count + i;
+        AppendLine(&t->lines, (Vector2) { s->trailX[from], s->trailY[from] }, (Vector2) { s->trailX[to], s->trailY[to] }, t->pen.width, t->pen.color);
+      }
+    }
+  }
+  s->trail = 0;
+}
+
+// Members [first, first + count) of all, trail included.
+Swarm SwarmGroup(const Swarm* all, size_t first, size_t count) {
+  Swarm s = {
+    .count = count,
+    .xs = all->xs + first,
+    .ys = all->ys + first,
+    .hx = all->hx + first,
+    .hy = all->hy + first,
+    .milli = all->milli + first,
+    .degrees = all->degrees + first,
+    .exact = all->exact,
+    .trailX = all->trailX + first * SWARM_TRAIL_ROWS,
+    .trailY = all->trailY + first * SWARM_TRAIL_ROWS,
+  };
+  return s;
+}
+
+typedef struct {
+  const Program* prog;
+  size_t body;      // first body instruction
+  size_t end;       // the matching OP_END
+  Swarm members;
+  Turtle* groups;   // pen state and lines of each group, like ClosedFormJob.starts
+  uint32_t* loops;  // prog->depth loop counters per group
+} SwarmJob;
+
+// Runs the body for one group of members, one instruction at a time across
+// the group.
+void RunSwarmGroup(void* ctx, size_t g) {
+  SwarmJob* job = ctx;
+  const Program* prog = job->prog;
+  Turtle* t = &job->groups[g];
+  uint32_t* loops = job->loops + g * prog->depth;
+  size_t first = g * SWARM_GROUP;
+  Swarm s = SwarmGroup(&job->members, first, job->members.count - first < SWARM_GROUP ? job->members.count - first : SWARM_GROUP);
+  size_t sp = 0;
+  for (size_t pc = job->body; pc < job->end; ++pc) {
+    const Instr* in = &prog->items[pc];
+    switch (in->op) {
+      case OP_MOVE: {
+        if (!t->pen.down) {
+          MoveSwarm(&s, in->as.amt);
+          break;
+        }
+        if (s.trail == 0)
+          RecordSwarmTrail(&s);
+        MoveSwarm(&s, in->as.amt);
+        RecordSwarmTrail(&s);
+        if (s.trail == SWARM_TRAIL_ROWS) {
+          FlushSwarmTrail(&s, t);
+          RecordSwarmTrail(&s);
+        }
+      } break;
+      case OP_TURN: TurnSwarm(&s, TurnAngle(in)); break;
+      case OP_TRAVEL: {
+        FlushSwarmTrail(&s, t);
+        for (size_t i = 0; i < s.count; ++i) {
+          float c = s.hx[i], sn = s.hy[i];
+          s.xs[i] += c*in->as.d.x - sn*in->as.d.y;
+          s.ys[i] += sn*in->as.d.x + c*in->as.d.y;
+        }
+      } break;
+      case OP_HOME: {
+        FlushSwarmTrail(&s, t);
+        for (size_t i = 0; i < s.count; ++i) {
+          s.xs[i] = SW / 2;
+          s.ys[i] = SH / 2;
+        }
+      } break;
+      case OP_PU:    FlushSwarmTrail(&s, t); t->pen.down = false; break;
+      case OP_PD:    t->pen.down = true; break;
+      case OP_SETPC: FlushSwarmTrail(&s, t); t->pen.color = in->as.color; break;
+      case OP_SETBG: t->background = in->as.color; break;
+      case OP_REPEAT: loops[sp++] = in->as.count; break;
+      case OP_END: {
+        if (--loops[sp-1] > 0)
+          pc = in->jump;
+        else
+          sp--;
+      } break;
+      case OP_CS:
+      case OP_SWARM:
+      case OP_CALL:
+      case OP_ARG:
+      case OP_COUNT: NOB_UNREACHABLE("RunSwarm");
+    }
+  }
+  FlushSwarmTrail(&s, t);
+}
+
+// Runs the body of the OP_SWARM at prog->items[pc] for all its members. The
+// groups run in parallel into their own line stores, which are then appended
+// in group order, the same AppendLine calls a single thread would make.
+// The turtle's own pose is left as it was, pen, color and background changes
+// stick.
+void RunSwarm(Turtle* t, const Program* prog, size_t pc) {
+  const Instr* in = &prog->items[pc];
+  size_t groups = (in->as.count + SWARM_GROUP - 1) / SWARM_GROUP;
+  SwarmJob job = {
+    .prog = prog, .body = pc + 1, .end = in->jump,
+    .members = CreateSwarm(t, in->as.count),
+    .groups = ArenaAlloc(&CommandArena, groups * sizeof(Turtle)),
+    .loops = ArenaAlloc(&CommandArena, (groups * prog->depth + 1) * sizeof(*job.loops)),
+  };
+  LineStore* stores = GetTaskStores(groups);
+  for (size_t g = 0; g < groups; ++g) {
+    job.groups[g] = *t;
+    job.groups[g].lines = stores[g];
+    job.groups[g].lines.noMerge = true;
+  }
+  ParallelFor(Exec.threads, groups, RunSwarmGroup, &job);
+
+  for (size_t g = 0; g < groups; ++g) {
+    LineStore* lines = &job.groups[g].lines;
+    AppendLines(&t->lines, lines);
+    ClearLineStore(lines);
+    stores[g] = *lines;
+  }
+  t->pen = job.groups[0].pen;
+  t->background = job.groups[0].background;
+}
+
+// Operand of a move, turn or call argument that may come from an argument.
+float Operand(const Instr* in, const float* args) {
+  return (in->flags & INSTR_ARG) ? in->as.arg.sign * args[in->as.arg.slot] : in->as.amt;
+}
+
+// What one call of a procedure draws and does, in the frame of the turtle
+// making it: the lines as if it started at the origin heading along x, the
+// transform from its start to its end pose, and the pen it leaves behind.
+typedef struct {
+  LineStore lines;
+  PoseTransform move;
+  Pen pen;
+  Color background;  // alpha 0 when the call doesn't set it
+  uint64_t steps;    // instructions the call runs
+} CallGeometry;
+
+// A call's geometry only depends on these. Zeroed before it's filled in, so
+// the padding compares equal too.
+typedef struct {
+  uint32_t proc;
+  uint32_t generation;
+  int32_t width;
+  Color color;
+  bool down;
+  float args[PROC_ARGS_CAP];
+} CallKey;
+
+#define CALL_CACHE_CAP 4096
+
+// Geometry of calls to cacheable procedures. Every such call is replayed from
+// here, a miss records the geometry first, so what's drawn doesn't depend on
+// what happens to be cached. Entries keep their line stores when the cache is
+// cleared, and only the thread running programs uses it.
+static struct {
+  struct { CallKey key; size_t value; }* index;
+  CallGeometry* items;  // items[used..count) are free
+  size_t count;
+  size_t capacity;
+  size_t used;
+  size_t recording;  // misses being recorded, the cache isn't cleared under them
+  size_t hits;
+  size_t misses;
+} CallCache = {0};
+
+void ClearCallCache(void) {
+  GROWTH(hmfree(CallCache.index));
+  CallCache.used = 0;
+}
+
+// Forgets every procedure, and with them everything cached about their calls.
+void FreeProcedures(void) {
+  for (size_t i = 0; i < Procs.count; ++i)
+    nob_da_free(Procs.items[i].body);
+  nob_da_free(Procs);
+  nob_da_free(Procs.free);
+  nob_da_free(Procs.pending);
+  nob_da_free(Procs.superseded);
+  shfree(Procs.index);
+  Procs = (Procedures) {0};
+  ClearCallCache();
+}
+
+void FreeCallCache(void) {
+  ClearCallCache();
+  for (size_t i = 0; i < CallCache.count; ++i)
+    FreeLineStore(&CallCache.items[i].lines);
+  nob_da_free(CallCache);
+  CallCache.items = NULL;
+  CallCache.count = CallCache.capacity = 0;
+}
+
+// Runs procedure proc from the origin into a free entry and returns its index.
+size_t RecordCall(const Turtle* t, size_t proc, const float* args) {
+  if (CallCache.used >= CALL_CACHE_CAP && CallCache.recording == 0)
+    ClearCallCache();
+  if (CallCache.used == CallCache.count)
+    GROWTH(nob_da_append(&CallCache, ((CallGeometry) { .lines.noMerge = true })));
+  size_t entry = CallCache.used++;
+
+  const Program* body = &Procs.items[proc].body;
+  Turtle r = {
+    .rotation = AngleFromMilli(0),
+    .heading = { 1, 0 },
+    .pen = t->pen,
+    .lines = CallCache.items[entry].lines,
+  };
+  ClearLineStore(&r.lines);
+  uint32_t stackLoops[LOOP_STACK_CAP];
+  uint32_t* loops = stackLoops;
+  if (body->depth > LOOP_STACK_CAP)
+    loops = ArenaAlloc(&CommandArena, body->depth * sizeof(*loops));
+  // Cacheable procedures only call cacheable ones, so no frames are pushed.
+  Vm vm = { .prog = body, .end = body->count, .loops = loops, .closedForm = Exec.closedForm, .args = args };
+  CallCache.recording++;
+  StepVm(&vm, &r, UINT64_MAX);
+  CallCache.recording--;
+
+  CallGeometry* g = &CallCache.items[entry];
+  g->lines = r.lines;
+  g->move = (PoseTransform) { .angle = r.rotation, .d = r.position };
+  g->pen = r.pen;
+  g->background = r.background;
+  g->steps = vm.steps;
+  return entry;
+}
+
+// Runs a call to cacheable procedure proc by drawing its cached geometry
+// turned and moved to the turtle's pose. Returns the instructions it stands for.
+uint64_t RunCachedCall(Turtle* t, size_t proc, const float* args) {
+  CallKey key;
+  memset(&key, 0, sizeof(key));
+  key.proc = (uint32_t)proc;
+  key.generation = Procs.items[proc].generation;
+  key.width = t->pen.width;
+  key.color = t->pen.color;
+  key.down = t->pen.down;
+  memcpy(key.args, args, Procs.items[proc].arity * sizeof(*args));
+  ptrdiff_t i;
+  GROWTH(i = hmgeti(CallCache.index, key));  // allocates the first time after a clear
+  size_t entry;
+  if (i >= 0) {
+    CallCache.hits++;
+    entry = CallCache.index[i].value;
+  } else {
+    CallCache.misses++;
+    entry = RecordCall(t, proc, args);
+    GROWTH(hmput(CallCache.index, key, entry));
+  }
+
+  const CallGeometry* g = &CallCache.items[entry];
+  const LineStore* lines = &g->lines;
+  float c = t->heading.x, s = t->heading.y;
+  Vector2 o = t->position;
+  ReserveVertices(&t->lines, lines->count);
+  for (size_t p = 0; p < lines->polylines.count; ++p) {
+    Polyline poly = lines->polylines.items[p];
+    float thickness = PolylineThickness(poly);
+    size_t end = PolylineEnd(lines, p);
+    Vector2 from = { o.x + c*lines->xs[poly.first] - s*lines->ys[poly.first], o.y + s*lines->xs[poly.first] + c*lines->ys[poly.first] };
+    for (size_t v = poly.first + 1; v < end; ++v) {
+      Vector2 to = { o.x + c*lines->xs[v] - s*lines->ys[v], o.y + s*lines->xs[v] + c*lines->ys[v] };
+      AppendLine(&t->lines, from, to, thickness, poly.color);
+      from = to;
+    }
+  }
+  ApplyTransform(t, g->move);
+  t->pen = g->pen;
+  if (g->background.a != 0)
+    t->background = g->background;
+  return g->steps;
+}
+
+// Runs until the range ends or at least maxSteps instructions have run (a
+// move run or cached call is never split) and returns whether the range
+// ended. The loop registers live in locals while running and go back into vm
+// on the way out.
+bool StepVm(Vm* vm, Turtle* t, uint64_t maxSteps) {
+  const Program* prog = vm->prog;
+  uint32_t* loops = vm->loops;
+  size_t pc = vm->pc, end = vm->end, sp = vm->sp, fp = vm->fp;
+  const float* args = vm->args;
+  uint64_t steps = vm->steps;
+  uint64_t limit = steps + maxSteps < steps ? UINT64_MAX : steps + maxSteps;
+  for (; steps < limit; ++pc) {
+    if (pc >= end) {
+      if (fp == 0)
+        break;
+      // Return, the loop increment moves past the call.
+      CallFrame* f = &vm->frames[--fp];
+      prog = f->prog;
+      pc = f->pc;
+      end = f->end;
+      args = f->args;
+      continue;
+    }
+    const Instr* in = &prog->items[pc];
+    if (in->flags & INSTR_MOVE_RUN) {
+      RunMoveRun(t, prog, pc, in->jump);
+      steps += in->jump - pc;
+      pc = in->jump - 1;
+      continue;
+    }
+    steps++;
+    switch (in->op) {
+      case OP_MOVE: {
+        Vector2 to = GetEnd(t->position, t->heading, Operand(in, args));
+        if (t->pen.down) {
+          AppendLine(&t->lines, t->position, to, t->pen.width, t->pen.color);
+        }
+        t->position = to;
+      } break;
+      case OP_TURN: {
+        Angle delta = (in->flags & INSTR_ARG) ? AngleFromDegrees(Operand(in, args)) : TurnAngle(in);
+        TurnTurtle(t, delta);
+      } break;
+      case OP_TRAVEL: {
+        float c = t->heading.x, s = t->heading.y;
+        t->position.x += c*in->as.d.x - s*in->as.d.y;
+        t->position.y += s*in->as.d.x + c*in->as.d.y;
+      } break;
+      case OP_HOME:  t->position = (Vector2) { .x = SW / 2, .y = SH / 2 }; break;
+      case OP_CS:    ClearLineStore(&t->lines); t->clears++; break;
+      case OP_SETBG: t->background = in->as.color; break;
+      case OP_SETPC: t->pen.color = in->as.color; break;
+      case OP_PD:    t->pen.down = true; break;
+      case OP_PU:    t->pen.down = false; break;
+      case OP_REPEAT: {
+        if (in->flags & INSTR_ARG) {
+          float count = Operand(in, args);
+          if (count < 1)
+            pc = in->jump;
+          else
+            loops[sp++] = count < (float)UINT32_MAX ? (uint32_t)count : UINT32_MAX;
+        } else if (vm->closedForm && (in->flags & INSTR_CLOSED_FORM) && in->as.count >= CLOSED_FORM_MIN_ITERATIONS) {
+          RunRepeatClosedForm(t, prog, pc, loops + sp);
+          steps += CountSteps(prog, pc, in->jump + 1) - 1;
+          pc = in->jump;
+        } else {
+          loops[sp++] = in->as.count;
+        }
+      } break;
+      case OP_SWARM: {
+        RunSwarm(t, prog, pc);
+        steps += CountSteps(prog, pc, in->jump + 1) - 1;
+        pc = in->jump;
+      } break;
+      case OP_END: {
+        // Jump back to the OP_REPEAT, the loop increment lands on the first body instruction.
+        if (--loops[sp-1] > 0)
+          pc = in->jump;
+        else
+          sp--;
+      } break;
+      case OP_CALL: {
+        const Procedure* proc = &Procs.items[in->as.count];
+        float values[PROC_ARGS_CAP];
+        for (size_t i = 0; i < proc->arity; ++i)
+          values[i] = Operand(&prog->items[pc + 1 + i], args);
+        pc += proc->arity;
+        if (proc->cacheable) {
+          steps += RunCachedCall(t, in->as.count, values);
+          break;
+        }
+        CallFrame* f = &vm->frames[fp++];
+        *f = (CallFrame) { .prog = prog, .pc = pc, .end = end, .args = args };
+        memcpy(f->values, values, sizeof(values));
+        prog = &proc->body;
+        end = prog->count;
+        args = f->values;
+        // The loop increment wraps around to the body's first instruction.
+        pc = SIZE_MAX;
+      } break;
+      case OP_ARG:
+      case OP_COUNT: NOB_UNREACHABLE("StepVm");
+    }
+  }
+  vm->prog = prog;
+  vm->pc = pc;
+  vm->end = end;
+  vm->sp = sp;
+  vm->fp = fp;
+  vm->args = args;
+  vm->steps = steps;
+  return pc >= end && fp == 0;
+}
+
+void UpdateTurtle(Turtle* t, const Program* prog) {
+  uint32_t stackLoops[LOOP_STACK_CAP];
+  uint32_t* loops = stackLoops;
+  if (prog->depth > LOOP_STACK_CAP)
+    loops = ArenaAlloc(&CommandArena, prog->depth * sizeof(*loops));
+  CallFrame frames[CALL_DEPTH_CAP];
+  Vm vm = { .prog = prog, .end = prog->count, .loops = loops, .closedForm = Exec.closedForm, .frames = frames };
+  StepVm(&vm, t, UINT64_MAX);
+}
+
+// Starts prog on a VM that is run a slice at a time with StepVm. The loop
+// and call stacks come from CommandArena, which must not be reset until it
+// finishes.
+void StartVm(Vm* vm, const Program* prog) {
+  size_t depth = prog->depth > 0 ? prog->depth : 1;
+  *vm = (Vm) {
+    .prog = prog,
+    .end = prog->count,
+    .loops = ArenaAlloc(&CommandArena, depth * sizeof(*vm->loops)),
+    .closedForm = Exec.closedForm,
+    .frames = ArenaAlloc(&CommandArena, CALL_DEPTH_CAP * sizeof(*vm->frames)),
+  };
+}
+
+// How far a run of prog is after steps instructions, from 0 to 1. Repeat
+// counts from arguments make Program.steps an estimate, so it's capped.
+float Progress(const Program* prog, uint64_t steps) {
+  if (prog->steps == 0 || steps >= prog->steps)
+    return 1;
+  return (float)((double)steps / (double)prog->steps);
+}
+
+// Vertices gathered per DrawSplineLinear call. Longer polylines are drawn in
+// chunks that share their boundary vertex.
+#define CANVAS_STRIP_CAP 1024
+
+void SyncCanvas(Canvas* canvas, const Turtle* t) {
+  const LineStore* lines = &t->lines;
+  bool cleared = t->clears != canvas->clears;
+  if (lines->merges != canvas->merges) {
+    // A merge moved the last vertex, which may already be drawn.
+    if (canvas->drawnVertices > 0)
+      canvas->drawnVertices--;
+    canvas->merges = lines->merges;
+  }
+  if (!cleared && canvas->drawnVertices >= lines->count)
+    return;
+  BeginTextureMode(canvas->target);
+  if (cleared) {
+    // Lines were cleared, start over.
+    ClearBackground(BLANK);
+    canvas->drawnPoly = 0;
+    canvas->drawnVertices = 0;
+    canvas->merges = lines->merges;
+    canvas->clears = t->clears;
+  }
+
+  Vector2 strip[CANVAS_STRIP_CAP];
+  for (size_t p = canvas->drawnPoly; p < lines->polylines.count; ++p) {
+    Polyline poly = lines->polylines.items[p];
+    size_t end = PolylineEnd(lines, p);
+    if (canvas->drawnVertices >= end)
+      continue;
+    // When a polyline grew since the last sync, start one line early so the
+    // join at the old end is drawn as part of the strip.
+    size_t begin = poly.first;
+    if (canvas->drawnVertices >= poly.first + 2)
+      begin = canvas->drawnVertices - 2;
+    while (begin + 1 < end) {
+      size_t n = end - begin < CANVAS_STRIP_CAP ? end - begin : CANVAS_STRIP_CAP;
+      for (size_t i = 0; i < n; ++i)
+        strip[i] = (Vector2) { lines->xs[begin + i], lines->ys[begin + i] };
+      DrawSplineLinear(strip, n, PolylineThickness(poly), poly.color);
+      begin += n - 1;
+    }
+  }
+  if (lines->polylines.count > 0)
+    canvas->drawnPoly = lines->polylines.count - 1;
+  canvas->drawnVertices = lines->count;
+  EndTextureMode();
+}
+
+void DrawCanvas(Canvas canvas) {
+  // Render textures are stored upside down.
+  Rectangle src = { 0, 0, canvas.target.texture.width, -canvas.target.texture.height };
+  DrawTextureRec(canvas.target.texture, src, (Vector2) { 0, 0 }, WHITE);
+}
+
+void ScrollHistoryPanel(HistoryPanel* panel, const CmdHistory* history, float wheel) {
+  if (wheel > 0 && panel->scroll + 1 < history->count)
+    panel->scroll++;
+  else if (wheel < 0 && panel->scroll > 0)
+    panel->scroll--;
+}
+
+void SyncHistoryPanel(HistoryPanel* panel, const CmdHistory* history, Font font) {
+  if (panel->drawn && panel->drawnCounter == history->counter && panel->drawnScroll == panel->scroll)
+    return;
+  BeginTextureMode(panel->target);
+  ClearBackground(BLANK);
+  float y = 0;
+  for (size_t i = panel->scroll; i < history->count && y < panel->target.texture.height; i++) {
+    size_t number = 0;
+    const CmdHistoryEntry* ch = GetCmdHistory(history, i, &number);
+    const char* text = FormatCmdHistoryEntry(&FrameArena, number, ch);
+    Color color = strlen(ch->error) > 0 ? RED : WHITE;
+    DrawTextEx(font, text, (Vector2) { 10, y }, HISTORY_ROW_HEIGHT, 1, color);
+    y += HISTORY_ROW_HEIGHT;
+  }
+  EndTextureMode();
+  panel->drawnCounter = history->counter;
+  panel->drawnScroll = panel->scroll;
+  panel->drawn = true;
+}
+
+void DrawHistoryPanel(HistoryPanel panel, Vector2 pos) {
+  Rectangle src = { 0, 0, panel.target.texture.width, -panel.target.texture.height };
+  DrawTextureRec(panel.target.texture, src, pos, WHITE);
+}
+
+TurtleCmds CreateCmds(void) {
+  TurtleCmds cmds = {0};
+  InsertCmd(&cmds, "Forward", "FD", true, CMD_FD, CAT_INT);
+  InsertCmd(&cmds, "Back", "BK", true, CMD_BK, CAT_INT);
+  InsertCmd(&cmds, "Left", "LT", true, CMD_LT, CAT_INT);
+  InsertCmd(&cmds, "Right", "RT", true, CMD_RT, CAT_INT);
+  InsertCmd(&cmds, "ClearScreen", "CS", false, CMD_CS, CAT_NONE);
+  InsertCmd(&cmds, "Home", "H", false, CMD_H, CAT_NONE);
+  InsertCmd(&cmds, "PenDown", "PD", false, CMD_PD, CAT_NONE);
+  InsertCmd(&cmds, "PenUp", "PU", false, CMD_PU, CAT_NONE);
+  InsertCmd(&cmds, "SetPenColor", "SETPC", true, CMD_SETPC, CAT_COLOR);
+  InsertCmd(&cmds, "SetBackground", "SETBG", true, CMD_SETBG, CAT_COLOR);
+  InsertCmd(&cmds, "Repeat", "RP", true, CMD_RP, CAT_BLOCK);
+  InsertCmd(&cmds, "Swarm", "SW", true, CMD_SWARM, CAT_BLOCK);
+  return cmds;
+}
+
+Turtle CreateTurtle(void) {
+  LineStore lines = {0};
+
+  Pen tpen = { 
+    .down = false,
     .color = LIME,
     .width = 5
   };
 
   Turtle turtle = {
     .position = CLITERAL(Vector2) { .x = SW / 2, .y = SH / 2 },
-    .rotation = 0,
+    .rotation = AngleFromMilli(0),
+    .heading = { 1, 0 },
     .size = 30,
     .pen = tpen,
+    .background = GetColor(0x181818FF),
     .lines = lines
   };
+  return turtle;
+}
+
+// CPU side image for rendering without a window or GPU.
+typedef struct {
+  int width;
+  int height;
+  Color* pixels;
+} Raster;
+
+Raster CreateRaster(int width, int height) {
+  Raster r = { width, height, malloc((size_t)width * height * sizeof(Color)) };
+  NOB_ASSERT(r.pixels != NULL && "Buy more RAM lol");
+  return r;
+}
+
+void ClearRaster(Raster* r, Color color) {
+  for (size_t i = 0; i < (size_t)r->width * r->height; ++i)
+    r->pixels[i] = color;
+}
+
+// Blends src over dst with src's alpha scaled by coverage (0..255).
+void BlendPixel(Color* dst, Color src, uint8_t coverage) {
+  int a = src.a * coverage / 255;
+  if (a == 255) {
+    *dst = src;
+    return;
+  }
+  dst->r = (src.r * a + dst->r * (255 - a)) / 255;
+  dst->g = (src.g * a + dst->g * (255 - a)) / 255;
+  dst->b = (src.b * a + dst->b * (255 - a)) / 255;
+}
+
+// Anti-aliased coverage of a thick line along one row of pixels. Pixel i sits
+// at u0 + i*du along the line and v0 + i*dv across it. Coverage is the product
+// of how far the pixel is inside the sides (half width h) and inside the ends
+// (0..len), each ramped over one pixel, scaled to 0..255 into out[0..n).
+//
+// Every variant does the same float operations in the same order, so they
+// produce identical bytes and the image doesn't depend on the CPU. That only
+// holds while the compiler doesn't contract a*b + c into an FMA in one of
+// them, which is why nob.c builds with -ffp-contract=off.
+typedef void (*CoverageFn)(uint8_t* out, int n, float u0, float du, float v0, float dv, float len, float h);
+
+void CoverageScalar(uint8_t* out, int n, float u0, float du, float v0, float dv, float len, float h) {
+  for (int i = 0; i < n; ++i) {
+    float x = (float)i;
+    float u = u0 + x * du;
+    float v = v0 + x * dv;
+    float side = fminf(fmaxf((h + 0.5f) - fabsf(v), 0.0f), 1.0f);
+    float ends = fminf(fmaxf(fminf(u, len - u) + 0.5f, 0.0f), 1.0f);
+    out[i] = (uint8_t)(int)(side * ends * 255.0f + 0.5f);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Both x86 kernels use min/max with the constant as the second operand, which
+// matches fminf/fmaxf for the non-NaN values coverage ever sees. Rows rarely
+// fill whole 16 pixel blocks, so what's left is done one vector at a time and
+// the last, partial vector goes through a scratch buffer. Lanes past n are
+// computed and thrown away.
+typedef struct {
+  __m128 u0, du, v0, dv, len, h;
+} Coverage4;
+
+__attribute__((target("sse2")))
+static inline __m128i CoverageVec4(const Coverage4* c, int i) {
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  const __m128 half = _mm_set1_ps(0.5f), scale = _mm_set1_ps(255.0f);
+  const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  __m128 x = _mm_add_ps(_mm_set1_ps((float)i), _mm_setr_ps(0, 1, 2, 3));
+  __m128 u = _mm_add_ps(c->u0, _mm_mul_ps(x, c->du));
+  __m128 v = _mm_add_ps(c->v0, _mm_mul_ps(x, c->dv));
+  __m128 side = _mm_min_ps(_mm_max_ps(_mm_sub_ps(c->h, _mm_and_ps(v, absMask)), zero), one);
+  __m128 ends = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_min_ps(u, _mm_sub_ps(c->len, u)), half), zero), one);
+  return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_mul_ps(side, ends), scale), half));
+}
+
+__attribute__((target("sse2")))
+void CoverageSSE2(uint8_t* out, int n, float u0, float du, float v0, float dv, float len, float h) {
+  Coverage4 c = {
+    _mm_set1_ps(u0), _mm_set1_ps(du), _mm_set1_ps(v0), _mm_set1_ps(dv),
+    _mm_set1_ps(len), _mm_set1_ps(h + 0.5f),
+  };
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i w0 = _mm_packs_epi32(CoverageVec4(&c, i), CoverageVec4(&c, i + 4));
+    __m128i w1 = _mm_packs_epi32(CoverageVec4(&c, i + 8), CoverageVec4(&c, i + 12));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(w0, w1));
+  }
+  for (; i < n; i += 4) {
+    __m128i w = _mm_packs_epi32(CoverageVec4(&c, i), _mm_setzero_si128());
+    int32_t bytes = _mm_cvtsi128_si32(_mm_packus_epi16(w, w));
+    memcpy(out + i, &bytes, n - i < 4 ? n - i : 4);
+  }
+}
+
+typedef struct {
+  __m256 u0, du, v0, dv, len, h;
+} Coverage8;
+
+__attribute__((target("avx2")))
+static inline __m256i CoverageVec8(const Coverage8* c, int i) {
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  const __m256 half = _mm256_set1_ps(0.5f), scale = _mm256_set1_ps(255.0f);
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256 x = _mm256_add_ps(_mm256_set1_ps((float)i), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7));
+  __m256 u = _mm256_add_ps(c->u0, _mm256_mul_ps(x, c->du));
+  __m256 v = _mm256_add_ps(c->v0, _mm256_mul_ps(x, c->dv));
+  __m256 side = _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(c->h, _mm256_and_ps(v, absMask)), zero), one);
+  __m256 ends = _mm256_min_ps(_mm256_max_ps(_mm256_add_ps(_mm256_min_ps(u, _mm256_sub_ps(c->len, u)), half), zero), one);
+  return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(side, ends), scale), half));
+}
+
+__attribute__((target("avx2")))
+void CoverageAVX2(uint8_t* out, int n, float u0, float du, float v0, float dv, float len, float h) {
+  Coverage8 c = {
+    _mm256_set1_ps(u0), _mm256_set1_ps(du), _mm256_set1_ps(v0), _mm256_set1_ps(dv),
+    _mm256_set1_ps(len), _mm256_set1_ps(h + 0.5f),
+  };
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    // The packs work per 128-bit lane, so fix the order up afterwards.
+    __m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(CoverageVec8(&c, i), CoverageVec8(&c, i + 8)), 0xD8);
+    __m128i b = _mm_packus_epi16(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+    _mm_storeu_si128((__m128i*)(out + i), b);
+  }
+  for (; i < n; i += 8) {
+    __m256i q = CoverageVec8(&c, i);
+    __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+    __m128i b = _mm_packus_epi16(w, w);
+    if (n - i >= 8) {
+      _mm_storel_epi64((__m128i*)(out + i), b);
+    } else {
+      uint8_t bytes[16];
+      _mm_storeu_si128((__m128i*)bytes, b);
+      memcpy(out + i, bytes, n - i);
+    }
+  }
+}
+#endif
+
+CoverageFn PickCoverageFn(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return CoverageAVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return CoverageSSE2;
+#endif
+  return CoverageScalar;
+}
+
+static CoverageFn Coverage = CoverageScalar;
+
+typedef struct {
+  size_t expected;   // participants the job should have
+  double deadline;
+  atomic_size_t joined;
+  atomic_bool slots[POOL_MAX_THREADS];
+} PoolCheck;
+
+// Holds its participant until all expected ones have joined, so the check
+// doesn't depend on how quickly the workers wake up.
+void PoolCheckTask(void* ctx, size_t i) {
+  NOB_UNUSED(i);
+  PoolCheck* check = ctx;
+  if (!atomic_exchange(&check->slots[ParallelSlot()], true))
+    atomic_fetch_add(&check->joined, 1);
+  while (atomic_load(&check->joined) < check->expected && NowSeconds() < check->deadline) {
+    struct timespec pause = { 0, 100000 };
+    nanosleep(&pause, NULL);
+  }
+}
+
+// Checks the pool isn't sized by the first job it runs: a job of two tasks
+// and then a large one must get every one of threads threads on the second.
+// Has to run before anything else starts the pool.
+bool RunPoolCheck(size_t threads) {
+  size_t counts[2] = { 2, 375 };
+  bool ok = true;
+  for (size_t k = 0; k < NOB_ARRAY_LEN(counts); ++k) {
+    size_t want = threads < POOL_MAX_THREADS ? threads : POOL_MAX_THREADS;
+    if (want > counts[k])
+      want = counts[k];
+    static PoolCheck check;
+    memset(&check, 0, sizeof(check));
+    check.expected = want;
+    check.deadline = NowSeconds() + 2.0;
+    ParallelFor(threads, counts[k], PoolCheckTask, &check);
+    size_t joined = atomic_load(&check.joined);
+    ok = ok && joined == want;
+    nob_log(joined == want ? NOB_INFO : NOB_ERROR, "pool: %zu/%zu threads took part in a %zu task job",
+            joined, want, counts[k]);
+  }
+  return ok;
+}
+
+#define TILE_SIZE 64
+
+// Pixel rectangle, x1/y1 exclusive.
+typedef struct {
+  int x0, y0, x1, y1;
+} PixelRect;
+
+// Longest run of pixels handed to Coverage at once.
+#define COVERAGE_SPAN 256
+
+// Coverage of one polyline within one tile. Lines of the same polyline are
+// merged with max before blending, so the strip's joins and self overlaps
+// are blended once, like a single stroke.
+typedef struct {
+  PixelRect clip;
+  PixelRect dirty;
+  uint8_t cov[TILE_SIZE * TILE_SIZE];  // row stride TILE_SIZE, relative to clip
+} TileCoverage;
+
+// Adds the anti-aliased coverage of the quad DrawLineEx draws (the segment
+// widened by thickness/2 on each side, with flat ends) to tc.
+void CoverLine(TileCoverage* tc, TLine line) {
+  PixelRect clip = tc->clip;
+  Vector2 d = { line.end.x - line.start.x, line.end.y - line.start.y };
+  float len = sqrtf(d.x*d.x + d.y*d.y);
+  if (isinf(len))
+    len = hypotf(d.x, d.y);  // squares overflow long before the length does
+  if (len == 0 || !isfinite(len))
+    return;
+  Vector2 dir = { d.x / len, d.y / len };
+  float h = line.thickness / 2;
+
+  // Rows are walked over the quad grown by the half pixel coverage ramps into.
+  float gh = h + 0.5f;
+  Vector2 n = { -dir.y * gh, dir.x * gh };
+  Vector2 a = { line.start.x - dir.x * 0.5f, line.start.y - dir.y * 0.5f };
+  Vector2 b = { line.end.x + dir.x * 0.5f, line.end.y + dir.y * 0.5f };
+  Vector2 q[4] = {
+    { a.x + n.x, a.y + n.y },
+    { b.x + n.x, b.y + n.y },
+    { b.x - n.x, b.y - n.y },
+    { a.x - n.x, a.y - n.y },
+  };
+
+  float minY = q[0].y, maxY = q[0].y;
+  for (int i = 1; i < 4; ++i) {
+    if (q[i].y < minY) minY = q[i].y;
+    if (q[i].y > maxY) maxY = q[i].y;
+  }
+  // Clamped in float, far off-screen rows don't fit in an int.
+  float fy0 = fmaxf(ceilf(minY - 0.5f), clip.y0);
+  float fy1 = fminf(floorf(maxY - 0.5f), clip.y1 - 1);
+  if (!(fy0 <= fy1))
+    return;
+  int y0 = (int)fy0, y1 = (int)fy1;
+
+  uint8_t cov[COVERAGE_SPAN];
+  for (int y = y0; y <= y1; ++y) {
+    // Intersect the row through the pixel centers with the quad's edges.
+    float cy = y + 0.5f;
+    float left = INFINITY, right = -INFINITY;
+    for (int i = 0; i < 4; ++i) {
+      Vector2 e0 = q[i], e1 = q[(i + 1) % 4];
+      if ((e0.y > cy && e1.y > cy) || (e0.y < cy && e1.y < cy))
+        continue;
+      float xa = e0.x, xb = e1.x;
+      if (e0.y != e1.y)
+        xa = xb = e0.x + (cy - e0.y) * (e1.x - e0.x) / (e1.y - e0.y);
+      left = fminf(left, fminf(xa, xb));
+      right = fmaxf(right, fmaxf(xa, xb));
+    }
+    // left and right stay infinite when no edge crosses the row.
+    float fx0 = fmaxf(ceilf(left - 0.5f), clip.x0);
+    float fx1 = fminf(floorf(right - 0.5f), clip.x1 - 1);
+    if (!(fx0 <= fx1))
+      continue;
+    int x0 = (int)fx0, x1 = (int)fx1;
+    if (x0 < tc->dirty.x0) tc->dirty.x0 = x0;
+    if (x1 + 1 > tc->dirty.x1) tc->dirty.x1 = x1 + 1;
+    if (y < tc->dirty.y0) tc->dirty.y0 = y;
+    if (y + 1 > tc->dirty.y1) tc->dirty.y1 = y + 1;
+
+    uint8_t* row = &tc->cov[(y - clip.y0) * TILE_SIZE - clip.x0];
+    for (int x = x0; x <= x1; x += COVERAGE_SPAN) {
+      int count = x1 - x + 1 < COVERAGE_SPAN ? x1 - x + 1 : COVERAGE_SPAN;
+      float px = x + 0.5f - line.start.x, py = cy - line.start.y;
+      float u0 = px * dir.x + py * dir.y;
+      float v0 = py * dir.x - px * dir.y;
+      Coverage(cov, count, u0, dir.x, v0, -dir.y, len, h);
+      for (int i = 0; i < count; ++i) {
+        if (cov[i] > row[x + i])
+          row[x + i] = cov[i];
+      }
+    }
+  }
+}
+
+void ResetCoverage(TileCoverage* tc) {
+  tc->dirty = (PixelRect) { tc->clip.x1, tc->clip.y1, tc->clip.x0, tc->clip.y0 };
+}
+
+// Blends the accumulated coverage in color and clears it for the next polyline.
+void FlushCoverage(Raster* r, TileCoverage* tc, Color color) {
+  for (int y = tc->dirty.y0; y < tc->dirty.y1; ++y) {
+    uint8_t* cov = &tc->cov[(y - tc->clip.y0) * TILE_SIZE - tc->clip.x0];
+    Color* row = &r->pixels[(size_t)y * r->width];
+    for (int x = tc->dirty.x0; x < tc->dirty.x1; ++x) {
+      if (cov[x]) {
+        BlendPixel(&row[x], color, cov[x]);
+        cov[x] = 0;
+      }
+    }
+  }
+  ResetCoverage(tc);
+}
+
+typedef struct {
+  const char* name;
+  CoverageFn fn;
+  int step;  // pixels per vector after the 16 pixel blocks, 0 for scalar
+} CoverageKernel;
+
+// One row handed to a coverage kernel.
+typedef struct {
+  int n;
+  float u0, du, v0, dv, len, h;
+} BenchRow;
+
+enum { BENCH_LONG_ROW = 1021, BENCH_ROWS = 200000 };
+
+// Long rows, sweeping angles and offsets so all coverage cases show up.
+BenchRow GetLongBenchRow(int r) {
+  float angle = r * 0.001f;
+  BenchRow row = {
+    .n = BENCH_LONG_ROW - r % 16,
+    .u0 = -20.0f + (r % 97) + (r % 7) * 0.37f, .du = cosf(angle),
+    .v0 = -30.0f + (r % 61) + (r % 5) * 0.21f, .dv = -sinf(angle),
+    .len = 800.0f, .h = 2.5f,
+  };
+  return row;
+}
+
+static BenchRow* benchRows;
+static size_t benchRowCount;
+
+void RecordCoverage(uint8_t* out, int n, float u0, float du, float v0, float dv, float len, float h) {
+  if (benchRowCount < BENCH_ROWS)
+    benchRows[benchRowCount++] = (BenchRow) { n, u0, du, v0, dv, len, h };
+  CoverageScalar(out, n, u0, du, v0, dv, len, h);
+}
+
+// Rows the renderer actually produces: thickness 5 lines of all angles and
+// lengths cut by one tile, recorded by swapping Coverage while CoverLine runs.
+// These are mostly a few pixels long.
+void RecordBenchRows(void) {
+  static TileCoverage tc;
+  tc.clip = (PixelRect) { 0, 0, TILE_SIZE, TILE_SIZE };
+  CoverageFn saved = Coverage;
+  Coverage = RecordCoverage;
+  for (int k = 0; benchRowCount < BENCH_ROWS; ++k) {
+    float angle = k * 0.7548777f;
+    float len = 2.0f + (k * 37 % 120) + (k % 3) * 0.25f;
+    Vector2 start = { -10.0f + (k * 13 % 84) + (k % 7) * 0.13f, -10.0f + (k * 29 % 84) + (k % 5) * 0.31f };
+    Vector2 end = { start.x + cosf(angle) * len, start.y - sinf(angle) * len };
+    ResetCoverage(&tc);
+    CoverLine(&tc, (TLine) { start, end, 5.0f, BLACK });
+  }
+  Coverage = saved;
+}
+
+// Times kernel over rows and checks every row against the scalar version.
+// Returns false if any row differs.
+bool BenchCoverageKernel(const char* set, CoverageKernel kernel, const BenchRow* rows, size_t count) {
+  static uint8_t expected[BENCH_LONG_ROW], got[BENCH_LONG_ROW];
+  uint64_t sum = 0;
+  size_t pixels = 0;
+  double start = NowSeconds();
+  for (size_t r = 0; r < count; ++r) {
+    const BenchRow* row = &rows[r];
+    kernel.fn(got, row->n, row->u0, row->du, row->v0, row->dv, row->len, row->h);
+    sum += got[r % row->n];
+    pixels += row->n;
+  }
+  double elapsed = NowSeconds() - start;
+
+  // Where the pixels went: whole 16 pixel blocks, single vectors, or the
+  // partial last vector that goes through scratch.
+  size_t blocks = 0, steps = 0, partial = 0, mismatches = 0;
+  for (size_t r = 0; r < count; ++r) {
+    const BenchRow* row = &rows[r];
+    if (kernel.step) {
+      int rest = row->n % 16;
+      blocks += row->n - rest;
+      steps += rest - rest % kernel.step;
+      partial += rest % kernel.step;
+    }
+    kernel.fn(got, row->n, row->u0, row->du, row->v0, row->dv, row->len, row->h);
+    CoverageScalar(expected, row->n, row->u0, row->du, row->v0, row->dv, row->len, row->h);
+    if (memcmp(expected, got, row->n) != 0)
+      mismatches++;
+  }
+
+  char split[128] = "";
+  if (kernel.step)
+    snprintf(split, sizeof(split), ", %4.1f%% in 16 px blocks, %4.1f%% in %d px steps, %4.1f%% in a partial vector",
+             100.0 * blocks / pixels, 100.0 * steps / pixels, kernel.step, 100.0 * partial / pixels);
+  nob_log(mismatches ? NOB_ERROR : NOB_INFO, "coverage %-5s %-6s: %8.1f Mpx/s%s, %zu/%zu rows differ from scalar (checksum %llu)",
+          set, kernel.name, pixels / elapsed / 1e6, split, mismatches, count, (unsigned long long)sum);
+  return mismatches == 0;
+}
+
+// Microbenchmark for the coverage kernels: times each one the CPU supports
+// on rows from real lines and on long rows.
+bool RunCoverageBench(void) {
+  CoverageKernel kernels[3] = { { "scalar", CoverageScalar, 0 } };
+  size_t count = 1;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    kernels[count++] = (CoverageKernel) { "sse2", CoverageSSE2, 4 };
+  if (__builtin_cpu_supports("avx2"))
+    kernels[count++] = (CoverageKernel) { "avx2", CoverageAVX2, 8 };
+#endif
+
+  benchRows = malloc(BENCH_ROWS * sizeof(*benchRows));
+  benchRowCount = 0;
+  RecordBenchRows();
+  size_t pixels = 0;
+  for (size_t r = 0; r < benchRowCount; ++r)
+    pixels += benchRows[r].n;
+  nob_log(NOB_INFO, "coverage: %zu rows from thickness 5 lines, %.1f px on average", benchRowCount, (double)pixels / benchRowCount);
+
+  bool same = true;
+  for (size_t k = 0; k < count; ++k)
+    same = BenchCoverageKernel("lines", kernels[k], benchRows, benchRowCount) && same;
+  for (int r = 0; r < BENCH_ROWS; ++r)
+    benchRows[r] = GetLongBenchRow(r);
+  for (size_t k = 0; k < count; ++k)
+    same = BenchCoverageKernel("long", kernels[k], benchRows, BENCH_ROWS) && same;
+  free(benchRows);
+  benchRows = NULL;
+  return same;
+}
+
+// Lines bucketed by the screen tiles their quads may touch. Tile t owns
+// items[offsets[t]..offsets[t+1]), in the original line order.
+typedef struct {
+  int cols;
+  int rows;
+  uint32_t* offsets;
+  LineRef* items;
+} TileBins;
+
+// Walks the tiles covered by line. With items == NULL it only counts into
+// offsets, otherwise it writes idx at each tile's cursor.
+void BinLine(TileBins* bins, TLine line, LineRef ref, uint32_t* cursors) {
+  // Half width plus the anti-aliasing fringe.
+  float h = line.thickness / 2 + 1;
+  float minX = fminf(line.start.x, line.end.x) - h, maxX = fmaxf(line.start.x, line.end.x) + h;
+  float minY = fminf(line.start.y, line.end.y) - h, maxY = fmaxf(line.start.y, line.end.y) + h;
+  // Endpoints run off to inf or nan when a program walks far enough, and
+  // far off-screen tiles don't fit in an int, so clamp to the grid in float.
+  if (!isfinite(minX) || !isfinite(maxX) || !isfinite(minY) || !isfinite(maxY))
+    return;
+  float fx0 = fmaxf(floorf(minX / TILE_SIZE), 0), fx1 = fminf(floorf(maxX / TILE_SIZE), bins->cols - 1);
+  float fy0 = fmaxf(floorf(minY / TILE_SIZE), 0), fy1 = fminf(floorf(maxY / TILE_SIZE), bins->rows - 1);
+  if (fx0 > fx1 || fy0 > fy1)
+    return;
+  int tx0 = (int)fx0, tx1 = (int)fx1;
+  int ty0 = (int)fy0, ty1 = (int)fy1;
+
+  // Skip tiles in the bounding box that are too far from the line itself,
+  // which matters for long diagonals.
+  Vector2 d = { line.end.x - line.start.x, line.end.y - line.start.y };
+  float len = sqrtf(d.x*d.x + d.y*d.y);
+  float reach = h + TILE_SIZE * 0.7072f;
+  for (int ty = ty0; ty <= ty1; ++ty) {
+    for (int tx = tx0; tx <= tx1; ++tx) {
+      if (len > 0) {
+        float cx = (tx + 0.5f) * TILE_SIZE - line.start.x;
+        float cy = (ty + 0.5f) * TILE_SIZE - line.start.y;
+        if (fabsf(cx * d.y - cy * d.x) > reach * len)
+          continue;
+      }
+      size_t t = (size_t)ty * bins->cols + tx;
+      if (cursors)
+        bins->items[cursors[t]++] = ref;
+      else
+        bins->offsets[t + 1]++;
+    }
+  }
+}
+
+TileBins BinLines(const LineStore* lines, int width, int height) {
+  TileBins bins = {
+    .cols = (width + TILE_SIZE - 1) / TILE_SIZE,
+    .rows = (height + TILE_SIZE - 1) / TILE_SIZE,
+  };
+  size_t tiles = (size_t)bins.cols * bins.rows;
+  bins.offsets = calloc(tiles + 1, sizeof(*bins.offsets));
+  for (LineRef ref = {0}; NextLine(lines, &ref);)
+    BinLine(&bins, GetLine(lines, ref), ref, NULL);
+  for (size_t t = 0; t < tiles; ++t)
+    bins.offsets[t + 1] += bins.offsets[t];
+
+  bins.items = malloc((bins.offsets[tiles] + 1) * sizeof(*bins.items));
+  uint32_t* cursors = malloc(tiles * sizeof(*cursors));
+  memcpy(cursors, bins.offsets, tiles * sizeof(*cursors));
+  for (LineRef ref = {0}; NextLine(lines, &ref);)
+    BinLine(&bins, GetLine(lines, ref), ref, cursors);
+  free(cursors);
+  return bins;
+}
+
+typedef struct {
+  Raster* raster;
+  const LineStore* lines;
+  const TileBins* bins;
+  TileCoverage* scratch;  // one per ParallelFor slot
+} TileJob;
+
+// The line at ref with its interior ends pushed out by half the thickness,
+// which fills the outside of the joins between consecutive lines.
+TLine GetStripLine(const LineStore* s, LineRef ref) {
+  TLine line = GetLine(s, ref);
+  Vector2 d = { line.end.x - line.start.x, line.end.y - line.start.y };
+  float len = sqrtf(d.x*d.x + d.y*d.y);
+  if (len == 0)
+    return line;
+  float h = line.thickness / 2;
+  Vector2 ext = { d.x / len * h, d.y / len * h };
+  if (ref.vertex - 1 > s->polylines.items[ref.poly].first) {
+    line.start.x -= ext.x;
+    line.start.y -= ext.y;
+  }
+  if (ref.vertex + 1 < PolylineEnd(s, ref.poly)) {
+    line.end.x += ext.x;
+    line.end.y += ext.y;
+  }
+  return line;
+}
+
+void RasterizeTile(void* ctx, size_t t) {
+  TileJob* job = ctx;
+  int tx = t % job->bins->cols, ty = t / job->bins->cols;
+  TileCoverage* tc = &job->scratch[ParallelSlot()];
+  tc->clip = (PixelRect) { tx * TILE_SIZE, ty * TILE_SIZE, (tx + 1) * TILE_SIZE, (ty + 1) * TILE_SIZE };
+  if (tc->clip.x1 > job->raster->width) tc->clip.x1 = job->raster->width;
+  if (tc->clip.y1 > job->raster->height) tc->clip.y1 = job->raster->height;
+  ResetCoverage(tc);
+
+  uint32_t begin = job->bins->offsets[t], end = job->bins->offsets[t + 1];
+  for (uint32_t i = begin; i < end; ++i) {
+    LineRef ref = job->bins->items[i];
+    CoverLine(tc, GetStripLine(job->lines, ref));
+    // Lines of a polyline are binned next to each other, blend once it ends.
+    if (i + 1 == end || job->bins->items[i + 1].poly != ref.poly)
+      FlushCoverage(job->raster, tc, job->lines->polylines.items[ref.poly].color);
+  }
+}
+
+// Tiles never share pixels and each tile draws its polylines in order, so
+// the image is the same for any thread count.
+void RasterizeLines(Raster* r, const LineStore* lines, size_t threads) {
+  TileBins bins = BinLines(lines, r->width, r->height);
+  TileJob job = { r, lines, &bins, calloc(threads > 0 ? threads : 1, sizeof(TileCoverage)) };
+  ParallelFor(threads, (size_t)bins.cols * bins.rows, RasterizeTile, &job);
+  free(job.scratch);
+  free(bins.offsets);
+  free(bins.items);
+}
+
+bool WritePPM(const char* path, Raster r) {
+  Nob_String_Builder sb = {0};
+  nob_sb_appendf(&sb, "P6\n%d %d\n255\n", r.width, r.height);
+  nob_da_reserve(&sb, sb.count + (size_t)r.width * r.height * 3);
+  for (size_t i = 0; i < (size_t)r.width * r.height; ++i) {
+    sb.items[sb.count++] = r.pixels[i].r;
+    sb.items[sb.count++] = r.pixels[i].g;
+    sb.items[sb.count++] = r.pixels[i].b;
+  }
+  bool ok = nob_write_entire_file(path, sb.items, sb.count);
+  nob_sb_free(sb);
+  return ok;
+}
+
+typedef struct {
+  const char* script;
+  const char* out;
+} BatchJob;
+
+typedef struct {
+  BatchJob* items;
+  size_t count;
+  size_t capacity;
+} BatchJobs;
+
+void Usage(const char* program) {
+  fprintf(stderr, "Usage: %s [--threads <n>] [--closed-form] [--script <file.logo> [--out <file.ppm>]]...\n", program);
+  fprintf(stderr, "       %s [--threads <n>] --bench\n", program);
+  fprintf(stderr, "  Without arguments the interactive window is opened.\n");
+  fprintf(stderr, "  With --script each script is run without a window and written as a PPM image.\n");
+  fprintf(stderr, "  --out defaults to the script path with a .ppm extension.\n");
+  fprintf(stderr, "  --threads sets how many threads rasterize and run closed form repeats and swarms, defaults to the number of CPUs.\n");
+  fprintf(stderr, "  --closed-form runs long repeats as independent chunks placed by composing the body's transform.\n");
+  fprintf(stderr, "  --bench runs the line coverage kernel microbenchmark, checks the kernels agree and that every pool thread takes part in jobs, and exits.\n");
+}
+
+// Runs every script through the same compiler and UpdateTurtle as the
+// interactive prompt and rasterizes the result on the CPU.
+int RunBatch(int argc, char** argv) {
+  const char* program = nob_shift(argv, argc);
+  BatchJobs jobs = {0};
+  size_t threads = CpuCount();
+  bool bench = false;
+  while (argc > 0) {
+    const char* flag = nob_shift(argv, argc);
+    if (strcmp(flag, "--bench") == 0) {
+      bench = true;
+    } else if (strcmp(flag, "--closed-form") == 0) {
+      Exec.closedForm = true;
+    } else if (strcmp(flag, "--threads") == 0 && argc > 0) {
+      threads = strtoul(nob_shift(argv, argc), NULL, 10);
+      if (threads == 0)
+        threads = 1;
+    } else if (strcmp(flag, "--script") == 0 && argc > 0) {
+      BatchJob job = { .script = nob_shift(argv, argc) };
+      nob_da_append(&jobs, job);
+    } else if (strcmp(flag, "--out") == 0 && argc > 0 && jobs.count > 0) {
+      nob_da_last(&jobs).out = nob_shift(argv, argc);
+    } else {
+      Usage(program);
+      return 1;
+    }
+  }
+  if (bench) {
+    bool ok = RunCoverageBench();
+    ok = RunPoolCheck(threads) && ok;
+    StopPool();
+    nob_da_free(jobs);
+    return ok ? 0 : 1;
+  }
+  if (jobs.count == 0) {
+    Usage(program);
+    return 1;
+  }
+
+  Coverage = PickCoverageFn();
+  Exec.threads = threads;
+  TurtleCmds cmds = CreateCmds();
+  Program prog = {0};
+  Raster raster = CreateRaster(SW, SH);
+  Nob_String_Builder src = {0};
+  size_t failed = 0;
+  size_t lines = 0;
+  size_t merges = 0;
+
+  double start = NowSeconds();
+  for (size_t i = 0; i < jobs.count; ++i) {
+    ArenaReset(&CommandArena);
+    BatchJob job = jobs.items[i];
+    const char* out = job.out;
+    if (out == NULL) {
+      Nob_String_View base = nob_sv_from_cstr(job.script);
+      if (nob_sv_end_with(base, ".logo"))
+        base.count -= strlen(".logo");
+      out = ArenaSprintf(&CommandArena, SV_Fmt".ppm", SV_Arg(base));
+    }
+
+    // Scripts don't share procedures.
+    FreeProcedures();
+    src.count = 0;
+    if (!nob_read_entire_file(job.script, &src)) {
+      failed++;
+      continue;
+    }
+    const char* error = "";
+    if (!CompileProgram(nob_sb_to_sv(src), &cmds, &prog, &error)) {
+      nob_log(NOB_ERROR, "%s: %s", job.script, error);
+      failed++;
+      continue;
+    }
+
+    Turtle turtle = CreateTurtle();
+    AllocMark mark = MarkAllocs();
+    UpdateTurtle(&turtle, &prog);
+    CheckAllocs(job.script, mark, true);
+    ClearRaster(&raster, turtle.background);
+    RasterizeLines(&raster, &turtle.lines, threads);
+    lines += turtle.lines.lines;
+    merges += turtle.lines.merges;
+    FreeLineStore(&turtle.lines);
+
+    if (!WritePPM(out, raster))
+      failed++;
+  }
+  double elapsed = NowSeconds() - start;
+
+  size_t done = jobs.count - failed;
+  nob_log(NOB_INFO, "rendered %zu/%zu scripts (%zu lines, %zu more merged into them) in %.3fs, %.1f scripts/s",
+          done, jobs.count, lines, merges, elapsed, elapsed > 0 ? done / elapsed : 0.0);
+
+  if (CallCache.hits + CallCache.misses > 0)
+    nob_log(NOB_INFO, "call cache: %zu hits, %zu misses", CallCache.hits, CallCache.misses);
+
+  StopPool();
+  FreeTaskStores();
+  FreeProcedures();
+  FreeCallCache();
+  free(raster.pixels);
+  ArenaFree(&CommandArena);
+  nob_da_free(prog);
+  nob_sb_free(src);
+  nob_da_free(jobs);
+  return failed == 0 ? 0 : 1;
+}
+
+// Lines from the interpreter thread to the render loop, plus the turtle's
+// state after them.
+#define LINE_BATCH_CAP 1024
+
+typedef struct {
+  TLine lines[LINE_BATCH_CAP];
+  uint32_t count;
+  size_t clears;      // Turtle.clears before these lines
+  uint64_t steps;     // of the running program, for the progress bar
+  bool done;          // the REQ_RUN finished with this batch
+  Vector2 position;
+  Vector2 heading;
+  Pen pen;
+  Color background;
+} LineBatch;
+
+// Single producer, single consumer: the interpreter fills the batch at head,
+// the render loop drains the one at tail. Each side only writes its own
+// index, the release/acquire pair on it hands the batch over.
+#define LINE_RING_CAP 64
+
+typedef struct {
+  LineBatch batches[LINE_RING_CAP];
+  atomic_size_t head;
+  atomic_size_t tail;
+} LineRing;
+
+typedef enum {
+  REQ_RUN,   // run prog, nothing else touches it until the done batch
+  REQ_TURN,  // arrow keys
+  REQ_MOVE,
+} RequestKind;
+
+typedef struct {
+  RequestKind kind;
+  const Program* prog;
+  Angle angle;
+  float distance;
+} Request;
+
+#define REQUEST_CAP 16
+
+// Runs programs and arrow key moves on its own thread, on its own Turtle.
+// The render loop only ever sees the lines and poses it publishes.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  Request requests[REQUEST_CAP];
+  size_t first;
+  size_t count;
+  atomic_bool quit;
+  LineRing ring;
+  // Owned by the interpreter thread.
+  Turtle turtle;
+  LineBatch* open;      // batch being filled, not published yet
+  double published;     // when the last batch went out
+} Interpreter;
+
+// Batches are published when full, at the end of a request and otherwise at
+// least this often, so the progress bar moves without flooding the ring.
+#define PUBLISH_INTERVAL 0.002
+
+bool PostRequest(Interpreter* in, Request req) {
+  pthread_mutex_lock(&in->lock);
+  bool ok = in->count < REQUEST_CAP;
+  if (ok) {
+    in->requests[(in->first + in->count) % REQUEST_CAP] = req;
+    in->count++;
+    pthread_cond_signal(&in->wake);
+  }
+  pthread_mutex_unlock(&in->lock);
+  return ok;
+}
+
+// The next free batch, waiting for the render loop to drain one if the
+// ring is full. NULL once the interpreter is told to quit.
+LineBatch* OpenBatch(Interpreter* in) {
+  size_t head = atomic_load_explicit(&in->ring.head, memory_order_relaxed);
+  while (head - atomic_load_explicit(&in->ring.tail, memory_order_acquire) >= LINE_RING_CAP) {
+    if (atomic_load(&in->quit))
+      return NULL;
+    struct timespec pause = { 0, 100000 };
+    nanosleep(&pause, NULL);
+  }
+  LineBatch* b = &in->ring.batches[head % LINE_RING_CAP];
+  b->count = 0;
+  b->clears = in->turtle.clears;
+  b->done = false;
+  return b;
+}
+
+void PublishBatch(Interpreter* in, uint64_t steps, bool done) {
+  LineBatch* b = in->open;
+  const Turtle* t = &in->turtle;
+  b->steps = steps;
+  b->done = done;
+  b->position = t->position;
+  b->heading = t->heading;
+  b->pen = t->pen;
+  b->background = t->background;
+  atomic_store_explicit(&in->ring.head, atomic_load_explicit(&in->ring.head, memory_order_relaxed) + 1, memory_order_release);
+  in->open = NULL;
+  in->published = NowSeconds();
+}
+
+// Publishes the open batch, or an empty one carrying just the pose.
+bool PublishNow(Interpreter* in, uint64_t steps, bool done) {
+  if (in->open == NULL && (in->open = OpenBatch(in)) == NULL)
+    return false;
+  PublishBatch(in, steps, done);
+  return true;
+}
+
+// Moves the lines the turtle drew since the last call into batches. The
+// interpreter's store doesn't merge, so the render loop gets every line as
+// it was drawn and merges them into its own store exactly like a single
+// store would have.
+bool FlushLines(Interpreter* in, uint64_t steps, bool done) {
+  LineStore* s = &in->turtle.lines;
+  // A CS since the batch was opened cleared the lines in it too.
+  if (in->open != NULL && in->open->clears != in->turtle.clears) {
+    in->open->count = 0;
+    in->open->clears = in->turtle.clears;
+  }
+  for (LineRef ref = {0}; NextLine(s, &ref);) {
+    if (in->open == NULL && (in->open = OpenBatch(in)) == NULL)
+      return false;
+    in->open->lines[in->open->count++] = GetLine(s, ref);
+    if (in->open->count == LINE_BATCH_CAP)
+      PublishBatch(in, steps, false);
+  }
+  ClearLineStore(s);
+  if (done || NowSeconds() - in->published >= PUBLISH_INTERVAL)
+    return PublishNow(in, steps, done);
+  return true;
+}
+
+// Instructions between line flushes.
+#define VM_SLICE_STEPS 4096
+
+void RunRequest(Interpreter* in, Request req) {
+  Turtle* t = &in->turtle;
+  switch (req.kind) {
+    case REQ_RUN: {
+      AllocMark mark = MarkAllocs();
+      size_t hits = CallCache.hits, misses = CallCache.misses;
+      Vm vm = {0};
+      StartVm(&vm, req.prog);
+      bool done = false;
+      while (!done) {
+        done = StepVm(&vm, t, VM_SLICE_STEPS);
+        if (!FlushLines(in, vm.steps, done))
+          break;
+      }
+      CheckAllocs("command", mark, true);
+      if (CallCache.hits != hits || CallCache.misses != misses)
+        nob_log(NOB_INFO, "call cache: %zu hits, %zu misses", CallCache.hits - hits, CallCache.misses - misses);
+      ArenaReset(&CommandArena);
+    } break;
+    case REQ_TURN:
+      TurnTurtle(t, req.angle);
+      PublishNow(in, 0, false);
+      break;
+    case REQ_MOVE: {
+      Vector2 end = GetEnd(t->position, t->heading, 100);
+      t->position = Vector2MoveTowards(t->position, end, req.distance);
+      PublishNow(in, 0, false);
+    } break;
+  }
+}
+
+void* InterpreterMain(void* arg) {
+  Interpreter* in = arg;
+  for (;;) {
+    pthread_mutex_lock(&in->lock);
+    while (in->count == 0 && !atomic_load(&in->quit))
+      pthread_cond_wait(&in->wake, &in->lock);
+    if (atomic_load(&in->quit)) {
+      pthread_mutex_unlock(&in->lock);
+      return NULL;
+    }
+    Request req = in->requests[in->first];
+    in->first = (in->first + 1) % REQUEST_CAP;
+    in->count--;
+    pthread_mutex_unlock(&in->lock);
+    RunRequest(in, req);
+  }
+}
+
+// The Interpreter is big (its ring holds the batches), keep it off the stack.
+void StartInterpreter(Interpreter* in) {
+  pthread_mutex_init(&in->lock, NULL);
+  pthread_cond_init(&in->wake, NULL);
+  atomic_init(&in->quit, false);
+  atomic_init(&in->ring.head, 0);
+  atomic_init(&in->ring.tail, 0);
+  in->turtle = CreateTurtle();
+  in->turtle.lines.noMerge = true;
+  int err = pthread_create(&in->thread, NULL, InterpreterMain, in);
+  NOB_ASSERT(err == 0 && "could not start the interpreter thread");
+}
+
+void StopInterpreter(Interpreter* in) {
+  pthread_mutex_lock(&in->lock);
+  atomic_store(&in->quit, true);
+  pthread_cond_signal(&in->wake);
+  pthread_mutex_unlock(&in->lock);
+  pthread_join(in->thread, NULL);
+  FreeLineStore(&in->turtle.lines);
+  pthread_cond_destroy(&in->wake);
+  pthread_mutex_destroy(&in->lock);
+}
+
+// Applies every published batch to the render side turtle t, which mirrors
+// the interpreter's. Returns whether a REQ_RUN finished.
+bool DrainLines(Interpreter* in, Turtle* t, uint64_t* steps) {
+  bool done = false;
+  size_t tail = atomic_load_explicit(&in->ring.tail, memory_order_relaxed);
+  while (tail != atomic_load_explicit(&in->ring.head, memory_order_acquire)) {
+    const LineBatch* b = &in->ring.batches[tail % LINE_RING_CAP];
+    if (b->clears != t->clears) {
+      ClearLineStore(&t->lines);
+      t->clears = b->clears;
+    }
+    for (uint32_t i = 0; i < b->count; ++i)
+      AppendLine(&t->lines, b->lines[i].start, b->lines[i].end, b->lines[i].thickness, b->lines[i].color);
+    t->position = b->position;
+    t->heading = b->heading;
+    t->pen = b->pen;
+    t->background = b->background;
+    *steps = b->steps;
+    done = done || b->done;
+    atomic_store_explicit(&in->ring.tail, ++tail, memory_order_release);
+  }
+  return done;
+}
+
+int main(int argc, char** argv) {
+  // The compiler, the interpreter thread and the pool workers all read these
+  // tables, so they are built up front rather than on first use.
+  InitColorIndex();
+  InitMilliSines();
+
+  if (argc > 1)
+    return RunBatch(argc, argv);
+
+  InitWindow(SW, SH, "turtle");
+
+  Font space12 = LoadFontEx("./assets/fonts/spaceInputFontSize_Mono/spaceInputFontSizeMono-Regular.ttf", 12, NULL, 0);
+  SetTextureFilter(space12.texture, TEXTURE_FILTER_BILINEAR);
+
+  Font spaceInputFontSize = LoadFontEx("./assets/fonts/spaceInputFontSize_Mono/spaceInputFontSizeMono-Regular.ttf", INPUT_FONT_SIZE, NULL, 0);
+  SetTextureFilter(spaceInputFontSize.texture, TEXTURE_FILTER_BILINEAR);
+  
+  TurtleCmds cmds = CreateCmds();
+  Turtle turtle = CreateTurtle();
+
+  Canvas canvas = { .target = LoadRenderTexture(SW, SH) };
+  BeginTextureMode(canvas.target);
+  ClearBackground(BLANK);
+  EndTextureMode();
 
   CmdHistory cmdHistory = {0};
-  TurtleCmd* tc = NULL;
+  Program program = {0};
 
   Nob_String_Builder inputText = {0};
   Vector2 inputBoxPos = { .x = 20, .y = 20};
 
+  Vector2 historyPos = { .x = 0, .y = inputBoxPos.y + INPUT_FONT_SIZE*1.5 };
+  HistoryPanel history = { .target = LoadRenderTexture(SW, SH - historyPos.y) };
+
+  // Programs run on the interpreter thread so input and drawing never wait
+  // for them, turtle only mirrors what it publishes. Arrow keys and new
+  // commands wait until the running program finishes.
+  static Interpreter interpreter = {0};
+  Exec.threads = CpuCount();
+  StartInterpreter(&interpreter);
+  bool running = false;
+  bool pending = false;  // program compiled, its line still in the prompt until posted
+  uint64_t steps = 0;
+
+  size_t frame = 0;
   while (!WindowShouldClose()) {
+    AllocMark frameMark = MarkAllocs();
     BeginDrawing();
-    ClearBackground(GetColor(0x181818FF));
+    ClearBackground(turtle.background);
 
     float degrees = 0.1;
     float speed = 0.1;
-    if (IsKeyDown(KEY_LEFT)) {
-      turtle.rotation -= d2r(degrees);
-    } else if (IsKeyDown(KEY_RIGHT)) {
-      turtle.rotation += d2r(degrees);
-    } else if (IsKeyDown(KEY_UP)) {
-      Vector2 end = GetEnd(turtle.position, turtle.rotation, 100);
-      turtle.position = Vector2MoveTowards(turtle.position, end, speed);
-    } else {
+    bool busy = running || pending;
+    if (!busy && IsKeyDown(KEY_LEFT)) {
+      PostRequest(&interpreter, (Request) { .kind = REQ_TURN, .angle = AngleFromDegrees(-degrees) });
+    } else if (!busy && IsKeyDown(KEY_RIGHT)) {
+      PostRequest(&interpreter, (Request) { .kind = REQ_TURN, .angle = AngleFromDegrees(degrees) });
+    } else if (!busy && IsKeyDown(KEY_UP)) {
+      PostRequest(&interpreter, (Request) { .kind = REQ_MOVE, .distance = speed });
+    } else if (!pending) {
       // Get char pressed (unicode character) on the queue
       int key = GetCharPressed();
 
       // Check if more characters have been pressed on the same frame
       while (key > 0 && inputText.count < MAX_INPUT_CHARS_COUNT) {
           if ((key >= 32) && (key <= 125)) 
-              nob_da_append(&inputText, (char)key);
+              GROWTH(nob_da_append(&inputText, (char)key));
 
           key = GetCharPressed();  // Check next character in the queue
       }
@@ -445,49 +3721,67 @@ int main(void) {
       if (IsKeyPressed(KEY_BACKSPACE)) {
         inputText.count--;
       } 
-      else if (IsKeyPressed(KEY_ENTER)) {
+      else if (IsKeyPressed(KEY_ENTER) && !running) {
         Nob_String_View text = nob_sb_to_sv(inputText);
-        tc = ParseCommandText(text, cmds, &cmdHistory);  
-        inputText.count = 0;
+        pending = CompileCommandText(text, &cmds, &program, &cmdHistory);
+        history.scroll = 0;
+        if (!pending)
+          inputText.count = 0;
       }
     }
 
-    if (tc) {
-      if (!UpdateTurtle(&turtle, tc, cmds)) {
-        CmdHistoryEntry ch = CreateCmdHistoryEntry(cmdHistory.counter-1, nob_sv_from_cstr(tc->arg), "invalid arg");
-        nob_da_append(&cmdHistory, ch);
-      }
-      tc = NULL;
+    // Arrow key moves can fill the queue, then the program waits for room
+    // and is retried every frame rather than dropped.
+    if (pending && PostRequest(&interpreter, (Request) { .kind = REQ_RUN, .prog = &program })) {
+      PushCmdHistory(&cmdHistory, nob_sb_to_sv(inputText), "");
+      inputText.count = 0;
+      pending = false;
+      running = true;
+      steps = 0;
     }
 
-    for (size_t i = 0; i < turtle.lines.count; ++i) {
-      TLine line = turtle.lines.items[i];
-      DrawLineEx(line.start, line.end, line.thickness, line.color);
-    }
+    if (DrainLines(&interpreter, &turtle, &steps))
+      running = false;
+
+    SyncCanvas(&canvas, &turtle);
+    DrawCanvas(canvas);
 
     DrawTurtle(turtle, space12);
 
     Nob_String_View sv = nob_sb_to_sv(inputText);
-    const char* _text = (char*)nob_temp_sv_to_cstr(sv);
+    const char* _text = ArenaSvToCstr(&FrameArena, sv);
     DrawTextEx(spaceInputFontSize, _text, inputBoxPos, INPUT_FONT_SIZE, 1, WHITE);
 
     DrawLine(5, INPUT_FONT_SIZE*1.3, 500, INPUT_FONT_SIZE*1.3, WHITE);
-
-    size_t y = inputBoxPos.y + INPUT_FONT_SIZE*1.5;
-    for (int i = cmdHistory.count-1; i >= 0; i--) {
-      CmdHistoryEntry ch = cmdHistory.items[i];
-      Vector2 pos = { .x = 10, .y = y };
-      char* _text = (char*)nob_temp_sv_to_cstr(ch.text);
-      DrawTextEx(spaceInputFontSize, _text, pos, INPUT_FONT_SIZE*0.6, 1, ch.color);
-      y += INPUT_FONT_SIZE*0.6;
-      if (y >= SH) break;
+    if (running) {
+      float progress = Progress(&program, steps);
+      DrawRectangle(5, INPUT_FONT_SIZE*1.3 - 2, 495*progress, 4, GREEN);
+      const char* status = ArenaSprintf(&FrameArena, "running %.0f%%", progress*100);
+      DrawTextEx(space12, status, (Vector2) { 510, INPUT_FONT_SIZE*1.3 - 6 }, 12, 1, WHITE);
     }
 
+    ScrollHistoryPanel(&history, &cmdHistory, GetMouseWheelMove());
+    SyncHistoryPanel(&history, &cmdHistory, spaceInputFontSize);
+    DrawHistoryPanel(history, historyPos);
+
     EndDrawing();
 
-    nob_temp_reset();
+    ArenaReset(&FrameArena);
+    char label[32];
+    snprintf(label, sizeof(label), "frame %zu", frame++);
+    CheckAllocs(label, frameMark, false);
   }
 
+  StopInterpreter(&interpreter);
+  StopPool();
+  FreeTaskStores();
+  FreeProcedures();
+  FreeCallCache();
+  FreeLineStore(&turtle.lines);
+  ArenaFree(&FrameArena);
+  ArenaFree(&CommandArena);
+  UnloadRenderTexture(history.target);
+  UnloadRenderTexture(canvas.target);
   UnloadFont(space12);
   UnloadFont(spaceInputFontSize);
   CloseWindow();